@@ -1,6 +1,8 @@
 #pragma once
 
+#include <algorithm>
 #include <cstdint>
+#include <limits>
 #include <vector>
 
 #include "utils/status.h"
@@ -26,6 +28,27 @@ namespace alp {
                             std::vector<idx_t> &result_ids,
                             std::vector<float> &result_distances) const = 0;
 
+      // k results for each of the n queries stored back to back, row major and best first, slots without a
+      // result get id -1
+      virtual Status search_batch(size_t n, const vec_t *queries, size_t k,
+                                  std::vector<idx_t> &result_ids,
+                                  std::vector<float> &result_distances) const {
+          result_ids.assign(n * k, -1);
+          result_distances.assign(n * k, std::numeric_limits<float>::max());
+
+          std::vector<idx_t> ids;
+          std::vector<float> distances;
+          for (size_t i = 0; i < n; ++i) {
+              auto s = search(queries + i * dimension(), k, ids, distances);
+              if (!s.ok()) {
+                  return s;
+              }
+              std::copy(ids.begin(), ids.end(), result_ids.begin() + i * k);
+              std::copy(distances.begin(), distances.end(), result_distances.begin() + i * k);
+          }
+          return Status::OK();
+      }
+
       virtual size_t dimension() const = 0;
 
       virtual size_t size() const = 0;
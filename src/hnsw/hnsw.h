@@ -1,371 +1,874 @@
-#include <iostream>
+#pragma once
 
 #include "ann/index.h"
 
+#include "utils/aligned_allocator.h"
 #include "utils/distance.h"
 #include "utils/executor.h"
+#include "utils/quantizer.h"
+#include "hnsw/visited_list.h"
 #include <vector>
 #include <cstring>
 
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <cmath>
 #include <unordered_map>
-#include <unordered_set>
 #include <queue>
 #include <random>
 #include <cassert>
 #include <cstdint>
-#include <map>
-#include <queue>
-#include <set>
 
 namespace alp::hnsw {
 
 
   inline std::default_random_engine level_generator_ = std::default_random_engine(0);
 
-  int get_random_level(int mult_) {
+  inline int get_random_level(double mult_) {
       std::uniform_real_distribution<double> distribution(0.0, 1.0);
-      double r = -log(distribution(level_generator_)) * mult_;
+      // 1 - u keeps the argument of log in (0, 1]
+      double r = -log(1.0 - distribution(level_generator_)) * mult_;
       return (int) r;
   }
 
 
+  // Points get dense uint32 ids in insertion order, labels_ maps them back to the ids they were added with.
+  // Level 0 adjacency is one array with a fixed stride of 1 + M_max uint32 per point, the neighbour count first,
+  // and the vectors are a parallel array whose rows start on cache lines. The few points above level 0 keep their
+  // upper levels in a separate array of the same layout, one block per level.
+  //
+  // quantize adds int8 codes of the vectors, searches then walk the graph on the codes and re-rank the ef points
+  // they end with on the vectors. Inserts always link on the vectors.
+  //
+  // With an executor, add only stores the points and build links them from several threads. Neighbour lists are
+  // guarded by a striped array of locks and a point whose level tops the graph holds the entry lock for its whole
+  // insert, as in the serial build each point still searches the graph linked so far.
   template<typename vec_t>
   class hnsw : public VectorIndex<vec_t> {
 
   public:
-      hnsw(int M, int M_max, int ef_construction, int ef_search) : M_(M), M_max_(M_max),
-                                                                   ef_construction_(ef_construction),
-                                                                   ef_search_(ef_search),
-                                                                   mult_(1 / log(1.0 * M)) {
+      // L2 ranks by squared distance and IP by negated inner product so that smaller is closer for both. COSINE
+      // stores unit length copies of the vectors and ranks them by L2, which orders them the same way.
+      // threads > 1 stages added points for a parallel build on an executor owned by the graph
+      hnsw(int M, int M_max, int ef_construction, int ef_search, int dim = 128, DistanceType type = L2,
+           int threads = 1)
+              : link_locks_(kLockStripes), type_(type), dim(dim), calc_(type == IP ? IP : L2, dim),
+                M_(M), M_max_(std::max(M, M_max)), ef_construction_(ef_construction), ef_search_(ef_search),
+                mult_(1 / log(1.0 * std::max(M, 2))) {
+          size_t row = kAlign / sizeof(vec_t);
+          vec_stride_ = (dim + row - 1) / row * row;
+          link_stride_ = 1 + M_max_;
+          code_stride_ = (dim + kAlign - 1) / kAlign * kAlign;
+          prefetch_bytes_ = std::min(vec_stride_ * sizeof(vec_t), kPrefetchLines * kAlign);
+          if (threads > 1) {
+              owned_executor_ = std::make_unique<Executor>(threads - 1);
+              executor_ = owned_executor_.get();
+          }
       }
 
   private:
-      using dis_label_pair = std::pair<float, idx_t>;
+      using dis_id_pair = std::pair<float, uint32_t>;
 
-      struct Edge {
-          [[nodiscard]] int size() const {
-              return size_;
-          }
+      static constexpr size_t kAlign = 64;
 
-          void add_edge(float dis, idx_t label) {
-              other_[size_++] = std::make_pair(dis, label);
-          }
+      static constexpr size_t kLockStripes = 4096;
 
-          void add_edge(std::pair<float, idx_t> &&edge) {
-              other_[size_++] = edge;
-          }
+      // cache lines of a vector prefetched ahead of its distance, the hardware prefetcher streams the rest
+      static constexpr size_t kPrefetchLines = 8;
 
-          void remove_further() {
-              // todo change to priority que
-              int index = 0;
-              auto further = other_[0].first;
-              for (int i = 1; i < size_; ++i) {
-                  if (other_[i].first > further) {
-                      index = i;
-                      further = other_[i].first;
-                  }
-              }
-              for (int i = index + 1; i < size_; ++i) {
-                  other_[i - 1] = other_[i];
-              }
-          }
+      // points linked per claim of a build worker
+      static constexpr size_t kBuildGrain = 64;
 
-          int remove_further(float dis, idx_t label) {
-              // todo change to priority que
-              int index = 0;
-              auto further = other_[0].first;
-              for (int i = 0; i < size_; ++i) {
-                  if (other_[i].first > further) {
-                      index = i;
-                      further = other_[i].first;
-                  }
-              }
-              int llabel = other_[index].second;
-              other_[index] = std::make_pair(dis, label);
-              return llabel;
+      struct less_cmp {
+          bool operator()(const dis_id_pair &lhs, const dis_id_pair &rhs) const {
+              return lhs.first < rhs.first;
           }
+      };
 
-          void remove(int label) {
-              for (int i = 0; i < size_; ++i) {
-                  if (other_[i].second == label) {
-                      for (int j = i; j < size_ - 1; ++j) {
-                          other_[j] = other_[j + 1];
-                      }
-                      --size_;
-                  }
-              }
+      struct greater_cmp {
+          bool operator()(const dis_id_pair &lhs, const dis_id_pair &rhs) const {
+              return lhs.first > rhs.first;
           }
+      };
 
-          int size_{};
-          dis_label_pair other_[0];
+      // visited marks of a search together with the buffers it works in, pooled so that a warm search does not
+      // allocate
+      struct SearchState : VisitedList {
+          using VisitedList::VisitedList;
+
+          // heaps of the candidates still to expand, closest on top, and of the ef closest found, furthest on top
+          std::vector<dis_id_pair> wait;
+          std::vector<dis_id_pair> near;
+          // neighbour lists copied out while a build links points concurrently
+          std::vector<uint32_t> links;
+          // query minus the code offset for quantized searches
+          std::vector<float> residual;
+          // unit length copy of a cosine query
+          std::vector<vec_t> normalized;
       };
 
-      // Start at 1, 0 represent the emtpy
-      uint32_t max_level_{};
+      const vec_t *point(uint32_t id) const {
+          return vectors_.data() + id * vec_stride_;
+      }
 
-      int entry_label_{};
+      // neighbour count followed by the neighbours of a point on a level
+      uint32_t *links(uint32_t id, int level) {
+          return level == 0 ? level0_.data() + id * link_stride_
+                            : upper_links_[id].data() + (level - 1) * link_stride_;
+      }
 
-      Executor scheduler_;
+      const uint32_t *links(uint32_t id, int level) const {
+          return const_cast<hnsw *>(this)->links(id, level);
+      }
 
-      const int dim{128};
+      void prefetch_point(uint32_t id) const {
+          auto p = reinterpret_cast<const char *>(point(id));
+          for (size_t i = 0; i < prefetch_bytes_; i += kAlign) {
+              __builtin_prefetch(p + i);
+          }
+      }
 
-      std::vector<std::map<int, Edge *>> level_edges_;
+      const int8_t *code(uint32_t id) const {
+          return codes_.data() + id * code_stride_;
+      }
 
-      std::unordered_map<idx_t , const vec_t *> points_;
+      void prefetch_code(uint32_t id) const {
+          auto p = reinterpret_cast<const char *>(code(id));
+          for (size_t i = 0; i < std::min(code_stride_, kPrefetchLines * kAlign); i += kAlign) {
+              __builtin_prefetch(p + i);
+          }
+      }
 
-      static Edge *create_edge(int M_max_) {
-          void *ptr = malloc(sizeof(Edge) + sizeof(dis_label_pair));
-          return new(ptr) Edge();
+      // ranking distance between two vectors, smaller is closer
+      float distance(const vec_t *a, const vec_t *b) const {
+          float dis = calc_(a, b, dim);
+          return type_ == IP ? -dis : dis;
       }
 
-      struct less_cmp {
-          bool operator()(const std::pair<float, idx_t> &lhs, const std::pair<float, idx_t> &rhs) const {
-              return lhs.first < rhs.first;
+      // distances from a query to the vectors of points
+      struct ExactDistance {
+          const hnsw *index;
+          const vec_t *query;
+
+          float operator()(uint32_t id) const {
+              return index->distance(query, index->point(id));
+          }
+
+          void prefetch(uint32_t id) const {
+              index->prefetch_point(id);
           }
       };
 
-      struct greater_cmp {
-          bool operator()(const std::pair<float, idx_t> &lhs, const std::pair<float, idx_t> &rhs) const {
-              return lhs.first > rhs.first;
+      // distances from a query to the codes of points, residual is the query minus the code offset and ip_bias
+      // the inner product of the query with the offset
+      struct CodeDistance {
+          const hnsw *index;
+          const vec_t *query;
+          const float *residual;
+          float ip_bias;
+
+          float operator()(uint32_t id) const {
+              if (index->type_ == IP) {
+                  return -(index->sq_scale_ * index->sq_calc_.ip_calc(query, index->code(id), index->dim) + ip_bias);
+              }
+              return index->sq_calc_.l2_calc(residual, index->code(id), index->dim, index->sq_scale_);
+          }
+
+          void prefetch(uint32_t id) const {
+              index->prefetch_code(id);
           }
       };
 
+      void encode(uint32_t id) {
+          const vec_t *p = point(id);
+          int8_t *c = codes_.data() + id * code_stride_;
+          for (int i = 0; i < dim; ++i) {
+              c[i] = clamp2T<int8_t>(p[i], sq_minmax_, sq_diff_);
+          }
+      }
 
-      std::set<dis_label_pair, less_cmp>
-      search_layer_to_queue(const vec_t *item, idx_t label, uint32_t level, int eq) {
-          std::unordered_set<int> visited_set(level_edges_[level - 1].size());
-          std::priority_queue<dis_label_pair, std::vector<dis_label_pair>, greater_cmp> wait_que;
-          std::set<dis_label_pair, less_cmp> near_neighbor;
+      std::mutex &link_lock(uint32_t id) const {
+          return link_locks_[id % kLockStripes];
+      }
 
-          auto cur_point = points_[label];
-          auto cur_point_edge = level_edges_[level - 1][label];
+      // the links of a point as links returns them, copied into buffer under the point's lock while a build links
+      // points concurrently
+      const uint32_t *read_links(uint32_t id, int level, uint32_t *buffer) const {
+          const uint32_t *l = links(id, level);
+          if (!concurrent_) {
+              return l;
+          }
+          std::lock_guard<std::mutex> lock(link_lock(id));
+          std::copy(l, l + 1 + l[0], buffer);
+          return buffer;
+      }
 
-          long dis = l2_distance(cur_point, item, dim);
+      // the ef closest points reachable from entry on a level, closest first, kept in state.near
+      template<typename Distance>
+      std::vector<dis_id_pair> &search_layer_to_queue(const Distance &distance, uint32_t entry, int level, int ef,
+                                                      SearchState &state) const {
+          state.reset();
+          state.links.resize(concurrent_ ? link_stride_ : 0);
+          auto &wait_que = state.wait;
+          auto &near_que = state.near;
+          wait_que.clear();
+          near_que.clear();
+
+          float dis = distance(entry);
+          state.visit(entry);
+          wait_que.emplace_back(dis, entry);
+          near_que.emplace_back(dis, entry);
 
-          near_neighbor.emplace(dis, label);
-          wait_que.emplace(dis, label);
           while (!wait_que.empty()) {
-              wait_que.pop();
-              if (dis <= (*near_neighbor.rbegin()).first) [[likely]] {
-                  for (int i = 0; i < cur_point_edge->size(); i++) {
-                      label = cur_point_edge->other_[i].second;
-                      if (visited_set.contains(label)) {
-                          continue;
-                      }
-                      visited_set.insert(label);
+              auto [cur_dis, cur] = wait_que.front();
+              if (cur_dis > near_que.front().first && near_que.size() >= static_cast<size_t>(ef)) {
+                  break;
+              }
+              std::pop_heap(wait_que.begin(), wait_que.end(), greater_cmp());
+              wait_que.pop_back();
+              if (!wait_que.empty()) {
+                  __builtin_prefetch(links(wait_que.front().second, level));
+              }
+
+              // the tags of all neighbours are fetched up front, the vectors of the unvisited ones prefetch_distance_
+              // neighbours ahead of their distance
+              const uint32_t *cur_links = read_links(cur, level, state.links.data());
+              uint32_t count = cur_links[0];
+              for (uint32_t i = 1; i <= count; i++) {
+                  state.prefetch(cur_links[i]);
+              }
+              for (uint32_t i = 1; i <= std::min(count, prefetch_distance_); i++) {
+                  if (!state.visited(cur_links[i])) {
+                      distance.prefetch(cur_links[i]);
+                  }
+              }
 
-                      cur_point = points_[cur_point_edge->other_[i].second];
-                      dis = l2distance(item, cur_point, dim);
-                      if (dis < (*near_neighbor.rbegin()).first || near_neighbor.size() < eq) {
-                          wait_que.emplace(dis, label);
+              for (uint32_t i = 1; i <= count; i++) {
+                  uint32_t next = cur_links[i];
+                  uint32_t ahead = i + prefetch_distance_;
+                  if (prefetch_distance_ > 0 && ahead <= count && !state.visited(cur_links[ahead])) {
+                      distance.prefetch(cur_links[ahead]);
+                  }
+                  if (!state.visit(next)) {
+                      continue;
+                  }
 
-                          if (near_neighbor.size() == eq) {
-                              near_neighbor.erase(std::prev(near_neighbor.end()));
-                          }
-                          near_neighbor.emplace(dis, label);
+                  dis = distance(next);
+                  if (near_que.size() < static_cast<size_t>(ef) || dis < near_que.front().first) {
+                      wait_que.emplace_back(dis, next);
+                      std::push_heap(wait_que.begin(), wait_que.end(), greater_cmp());
+                      near_que.emplace_back(dis, next);
+                      std::push_heap(near_que.begin(), near_que.end(), less_cmp());
+                      if (near_que.size() > static_cast<size_t>(ef)) {
+                          std::pop_heap(near_que.begin(), near_que.end(), less_cmp());
+                          near_que.pop_back();
                       }
                   }
-                  dis = wait_que.top().first;
-                  cur_point_edge = level_edges_[level - 1][wait_que.top().second];
-                  continue;
               }
-              break;
           }
-          return std::move(near_neighbor);
-      }
 
-      int search_layer_down(const vec_t *item, idx_t label, uint32_t level) {
-          std::unordered_set<int> visited_set(level_edges_[level - 1].size());
-          dis_label_pair near_que;
-          std::priority_queue<dis_label_pair, std::vector<dis_label_pair>, greater_cmp> wait_que;
+          std::sort_heap(near_que.begin(), near_que.end(), less_cmp());
+          return near_que;
+      }
 
-          auto cur_point = points_[label];
-          auto cur_point_edge = level_edges_[level - 1][label];
+      // greedy walk towards item on a level
+      template<typename Distance>
+      uint32_t search_layer_down(const Distance &distance, uint32_t entry, int level) const {
+          float dis = distance(entry);
+          std::vector<uint32_t> buffer(concurrent_ ? link_stride_ : 0);
+
+          bool changed = true;
+          while (changed) {
+              changed = false;
+              const uint32_t *cur_links = read_links(entry, level, buffer.data());
+              uint32_t count = cur_links[0];
+              for (uint32_t i = 1; i <= std::min(count, prefetch_distance_); i++) {
+                  distance.prefetch(cur_links[i]);
+              }
+              for (uint32_t i = 1; i <= count; i++) {
+                  if (prefetch_distance_ > 0 && i + prefetch_distance_ <= count) {
+                      distance.prefetch(cur_links[i + prefetch_distance_]);
+                  }
+                  float next_dis = distance(cur_links[i]);
+                  if (next_dis < dis) {
+                      dis = next_dis;
+                      entry = cur_links[i];
+                      changed = true;
+                  }
+              }
+          }
+          return entry;
+      }
 
-          long dis = l2distance(cur_point, item, dim);
+      // adds the neighbours of the candidates on a level, the candidates end up sorted closest first again
+      void extend_candidates(uint32_t id, std::vector<dis_id_pair> &candidates, int level) const {
+          auto visited = visited_pool_.get(labels_.size());
+          std::vector<uint32_t> buffer(concurrent_ ? link_stride_ : 0);
+          visited->visit(id);
+          for (auto &c: candidates) {
+              visited->visit(c.second);
+          }
 
-          near_que = std::make_pair(dis, label);
-          wait_que.emplace(dis, label);
-          while (!wait_que.empty()) {
-              wait_que.pop();
-              if (dis <= near_que.first) [[likely]] {
-                  for (int i = 0; i < cur_point_edge->size(); i++) {
-                      label = cur_point_edge->other_[i].second;
-                      if (visited_set.contains(label)) {
-                          continue;
-                      }
-                      visited_set.insert(label);
+          size_t n = candidates.size();
+          for (size_t i = 0; i < n; ++i) {
+              const uint32_t *l = read_links(candidates[i].second, level, buffer.data());
+              for (uint32_t j = 1; j <= l[0]; ++j) {
+                  if (visited->visit(l[j])) {
+                      candidates.emplace_back(distance(point(id), point(l[j])), l[j]);
+                  }
+              }
+          }
+          std::sort(candidates.begin(), candidates.end(), less_cmp());
+      }
 
-                      cur_point = points_[cur_point_edge->other_[i].second];
-                      dis = l2distance(item, cur_point, dim);
+      // Diversity heuristic of the hnsw paper: candidates are taken closest first and one is kept only while it is
+      // closer to the base point than to every point kept so far, which leaves edges pointing in different
+      // directions instead of a cluster of near duplicates. keep_pruned_ fills the remaining slots with the
+      // rejected candidates. candidates is sorted closest first and replaced by at most m kept points.
+      void select_neighbours(std::vector<dis_id_pair> &candidates, size_t m) const {
+          if (candidates.size() <= m) {
+              return;
+          }
 
-                      if (dis < near_que.first) {
-                          wait_que.emplace(dis, label);
-                          near_que = std::make_pair(dis, label);
-                      }
+          std::vector<dis_id_pair> kept;
+          std::vector<dis_id_pair> pruned;
+          kept.reserve(m);
+          for (auto &c: candidates) {
+              if (kept.size() >= m) {
+                  break;
+              }
+              bool diverse = true;
+              for (auto &k: kept) {
+                  if (distance(point(c.second), point(k.second)) < c.first) {
+                      diverse = false;
+                      break;
                   }
-                  dis = wait_que.top().first;
-                  cur_point_edge = level_edges_[level - 1][wait_que.top().second];
-                  continue;
               }
-              break;
+              if (diverse) {
+                  kept.push_back(c);
+              } else if (keep_pruned_) {
+                  pruned.push_back(c);
+              }
+          }
+          for (size_t i = 0; i < pruned.size() && kept.size() < m; ++i) {
+              kept.push_back(pruned[i]);
           }
-          return near_que.second;
+          candidates.swap(kept);
       }
 
-      void search_layer(const vec_t *item, idx_t label, uint32_t level, const int eq, std::vector<idx_t> &n_set) {
-          std::unordered_set<int> visited_set(level_edges_[level - 1].size());
-          std::priority_queue<dis_label_pair, std::vector<dis_label_pair>, less_cmp> near_que;
-          std::priority_queue<dis_label_pair, std::vector<dis_label_pair>, less_cmp> wait_que;
-
-          auto cur_point = points_[label];
-          auto cur_point_edge = level_edges_[level - 1][label];
+      // writes the links of id on a level to the neighbours selected from its candidates, which candidates is
+      // replaced by
+      void connect(uint32_t id, std::vector<dis_id_pair> &candidates, int level) {
+          if (extend_candidates_) {
+              extend_candidates(id, candidates, level);
+          }
+          select_neighbours(candidates, M_);
 
-          long dis = l2distance(cur_point, item, dim);
+          std::unique_lock<std::mutex> lock(link_lock(id), std::defer_lock);
+          if (concurrent_) {
+              lock.lock();
+          }
+          uint32_t *id_links = links(id, level);
+          id_links[0] = static_cast<uint32_t>(candidates.size());
+          for (size_t i = 0; i < candidates.size(); ++i) {
+              id_links[i + 1] = candidates[i].second;
+          }
+      }
 
-          near_que.emplace(dis, label);
-          wait_que.emplace(dis, label);
-          while (!wait_que.empty()) {
-              if (near_que.empty() || dis > near_que.top().first) [[likely]] {
-                  for (int i = 0; i < cur_point_edge->size(); i++) {
-                      label = cur_point_edge->other_[i].second;
-                      if (visited_set.contains(label)) {
-                          continue;
-                      }
-                      visited_set.insert(label);
-
-                      cur_point = points_[cur_point_edge->other_[i].second];
-                      dis = l2distance(item, cur_point, dim);
-
-                      if (dis < near_que.top().first || near_que.size() < eq) {
-                          if (near_que.size() == eq) {
-                              near_que.pop();
-                              near_que.emplace(dis, label);
-                          }
-                          wait_que.emplace(dis, label);
-                          near_que.emplace(dis, label);
-                      }
-                  }
-                  dis = wait_que.top().first;
-                  cur_point = points_[wait_que.top().second];
-                  wait_que.pop();
+      // links the neighbours connect selected on a level back to id, a neighbour list that overflows is shrunk to
+      // M_max with the same selection
+      void connect_back(uint32_t id, const std::vector<dis_id_pair> &neighbours, int level) {
+          std::vector<dis_id_pair> shrink;
+          shrink.reserve(M_max_ + 1);
+          for (auto [dis, neighbour]: neighbours) {
+              std::unique_lock<std::mutex> lock(link_lock(neighbour), std::defer_lock);
+              if (concurrent_) {
+                  lock.lock();
+              }
+              uint32_t *neighbour_links = links(neighbour, level);
+              if (neighbour_links[0] < static_cast<uint32_t>(M_max_)) {
+                  neighbour_links[++neighbour_links[0]] = id;
                   continue;
               }
-              break;
+
+              shrink.clear();
+              shrink.emplace_back(dis, id);
+              for (uint32_t j = 1; j <= neighbour_links[0]; ++j) {
+                  shrink.emplace_back(distance(point(neighbour), point(neighbour_links[j])), neighbour_links[j]);
+              }
+              std::sort(shrink.begin(), shrink.end(), less_cmp());
+              select_neighbours(shrink, M_max_);
+
+              neighbour_links[0] = static_cast<uint32_t>(shrink.size());
+              for (size_t j = 0; j < shrink.size(); ++j) {
+                  neighbour_links[j + 1] = shrink[j].second;
+              }
+          }
+      }
+
+      // the ef closest points of the bottom level, closest first, kept in state.near
+      std::vector<dis_id_pair> &search_base(const vec_t *query, int ef, SearchState &state) const {
+          if (max_level_.load(std::memory_order_acquire) < 0) {
+              state.near.clear();
+              return state.near;
+          }
+          auto entry = entry_.load(std::memory_order_acquire);
+          if (!quantized_) {
+              ExactDistance exact_distance{this, query};
+              for (int level = levels_[entry]; level > 0; level--) {
+                  entry = search_layer_down(exact_distance, entry, level);
+              }
+              return search_layer_to_queue(exact_distance, entry, 0, ef, state);
+          }
+
+          state.residual.resize(dim);
+          float query_sum = 0;
+          for (int i = 0; i < dim; ++i) {
+              state.residual[i] = static_cast<float>(query[i] - sq_offset_);
+              query_sum += static_cast<float>(query[i]);
           }
-          while (!near_que.empty()) {
-              n_set.emplace_back(near_que.top().second);
-              near_que.pop();
+          CodeDistance code_distance{this, query, state.residual.data(), sq_offset_ * query_sum};
+          for (int level = levels_[entry]; level > 0; level--) {
+              entry = search_layer_down(code_distance, entry, level);
           }
+          auto &que = search_layer_to_queue(code_distance, entry, 0, ef, state);
+          for (auto &[dis, id]: que) {
+              dis = distance(query, point(id));
+          }
+          std::sort(que.begin(), que.end(), less_cmp());
+          return que;
       }
 
+      // copies a point into the arrays and draws its level, the graph is left untouched
+      uint32_t store(const vec_t *item, idx_t label);
+
+      // links a stored point into the graph, safe to call from several threads while concurrent_ is set
+      void link(uint32_t id);
+
   public:
-      // you can add more parameter to initialize hnsw
-      hnsw() = default;
+      void insert(const vec_t *item, idx_t label);
+
+      std::vector<idx_t> query(const vec_t *query, int k) const;
+
+      void query(const vec_t *query, int k, std::vector<idx_t> *result) const;
+
+      // with an executor the point is only stored and joins the graph on build
+      Status add(idx_t id, const vec_t *vec_ptr) override {
+          if (label_map_.contains(id)) {
+              return Status::InvalidArgument();
+          }
+          if (executor_ != nullptr) {
+              pending_.push_back(store(vec_ptr, id));
+          } else {
+              insert(vec_ptr, id);
+          }
+          return Status::OK();
+      }
+
+      // the id is the insertion order
+      Status add(const vec_t *vec_ptr) override {
+          return add(static_cast<idx_t>(labels_.size()), vec_ptr);
+      }
+
+      // links the points staged by add, without an executor the graph is built as vectors are added
+      Status build() override;
+
+      // Trains an int8 scalar quantizer on the range of the stored vectors and encodes them, later points are
+      // encoded as they are added. Searches traverse on the codes from then on.
+      Status quantize();
+
+      // Renumbers the points in breadth first order of the bottom level from the entry point, visiting the
+      // neighbours of a point by increasing degree as Cuthill-McKee does, so points linked to each other sit close
+      // in memory. Vectors and links are permuted to match and the labels keep pointing at the same vectors.
+      // Staged points are linked first, no search may run meanwhile.
+      Status reorder();
+
+      // shares an executor with the caller instead of the one owned by the graph, nullptr inserts on add
+      void set_executor(Executor *executor) {
+          executor_ = executor;
+      }
+
+      // L2 distances, inner products for an IP index and cosine similarities for a cosine index
+      Status search(const vec_t *query_vec, size_t k,
+                    std::vector<idx_t> &result_ids,
+                    std::vector<float> &result_distances) const override;
+
+      size_t dimension() const override {
+          return dim;
+      }
+
+      size_t size() const override {
+          return labels_.size();
+      }
+
+      // preallocates the arrays for n points
+      void reserve(size_t n) {
+          labels_.reserve(n);
+          levels_.reserve(n);
+          vectors_.reserve(n * vec_stride_);
+          level0_.reserve(n * link_stride_);
+          upper_links_.reserve(n);
+          if (type_ == COSINE) {
+              norms_.reserve(n);
+          }
+          if (quantized_) {
+              codes_.reserve(n * code_stride_);
+          }
+      }
 
-      void insert(const vec_t *item, idx_t label) override;
+      // size of the candidate list of a search, at least k is used
+      void set_ef(int ef) {
+          ef_search_ = ef;
+      }
 
-      std::vector<int> query(const vec_t *query, int k) override;
+      // neighbours whose vectors are prefetched ahead of their distance during a search, 0 turns prefetching off
+      void set_prefetch_distance(uint32_t distance) {
+          prefetch_distance_ = distance;
+      }
 
-      void query(const vec_t *query, int k, std::vector<idx_t> *result);
+      // variants of the neighbour selection: extend_candidates also weighs the neighbours of the candidates found
+      // by an insert, keep_pruned fills up the neighbour lists with rejected candidates, both off by default
+      void set_neighbour_selection(bool extend_candidates, bool keep_pruned) {
+          extend_candidates_ = extend_candidates;
+          keep_pruned_ = keep_pruned;
+      }
 
-      ~hnsw() override {
-          for (auto &level_edge: level_edges_) {
-              for (auto &edge: level_edge) {
-                  free(edge.second);
+      bool reconstruct(idx_t label, vec_t *vec_ptr) const {
+          auto it = label_map_.find(label);
+          if (it == label_map_.end()) {
+              return false;
+          }
+          const vec_t *p = point(it->second);
+          std::copy(p, p + dim, vec_ptr);
+          if (type_ == COSINE) {
+              for (int i = 0; i < dim; ++i) {
+                  vec_ptr[i] *= norms_[it->second];
               }
           }
+          return true;
       }
 
+      ~hnsw() override = default;
+
   private:
+      // level of the entry point, -1 for an empty graph
+      std::atomic<int> max_level_{-1};
+
+      std::atomic<uint32_t> entry_{0};
+
+      // held by an insert raising the top level until its point becomes the entry
+      std::mutex entry_mutex_;
+
+      // striped locks of the neighbour lists, only taken while concurrent_ is set
+      mutable std::vector<std::mutex> link_locks_;
+      bool concurrent_ = false;
+
+      // points stored by add waiting for build
+      std::vector<uint32_t> pending_;
+
+      std::unique_ptr<Executor> owned_executor_;
+      Executor *executor_ = nullptr;
+
+      DistanceType type_ = L2;
+
+      const int dim{128};
+
+      DistanceCalc<vec_t> calc_;
+
+      size_t vec_stride_;
+      size_t link_stride_;
+      size_t prefetch_bytes_;
+      size_t code_stride_;
+      uint32_t prefetch_distance_ = 3;
+
+      // per point, indexed by its internal id
+      std::vector<vec_t, AlignedAllocator<vec_t, kAlign>> vectors_;
+      std::vector<uint32_t, AlignedAllocator<uint32_t, kAlign>> level0_;
+      std::vector<std::vector<uint32_t>> upper_links_;
+      std::vector<uint8_t> levels_;
+      std::vector<idx_t> labels_;
+      // original norms of the vectors of a cosine index
+      std::vector<float> norms_;
+      // int8 codes of the vectors once quantized
+      std::vector<int8_t, AlignedAllocator<int8_t, kAlign>> codes_;
+
+      bool quantized_ = false;
+      Minmax<vec_t> sq_minmax_;
+      double sq_diff_ = 1;
+      // a code decodes to sq_offset_ + sq_scale_ * code
+      float sq_offset_ = 0;
+      float sq_scale_ = 0;
+      SQDistanceCalc<int8_t, vec_t> sq_calc_;
+
+      std::unordered_map<idx_t, uint32_t> label_map_;
+
+      mutable VisitedListPool<SearchState> visited_pool_;
+
       int M_ = 30;
       int M_max_ = 30;
       int ef_construction_ = 100;
       int ef_search_ = 100;
+      bool extend_candidates_ = false;
+      bool keep_pruned_ = false;
       const double mult_;
   };
 
   template<typename vec_t>
-  void hnsw<vec_t>::insert(const vec_t *item, idx_t label) {
-      uint32_t random_level = get_random_level(mult_) + 1;
-      auto level_index = max_level_;
-      auto entry_label = entry_label_;
-      for (; level_index > random_level; level_index--) {
-          entry_label = search_layer_down(item, entry_label, level_index);
-      }
-
-      if (random_level > max_level_) {
-          for (auto i = max_level_; i < random_level; i++) {
-              level_edges_.emplace_back();
-              level_edges_[i].emplace(label, create_edge());
-          }
-      }
-
-      std::set<dis_label_pair, less_cmp> que;
-      dis_label_pair neighbour_pair;
-      Edge *neighbour_edge;
-      Edge *cur_level_edge;
-      points_.emplace(label, item);
-      for (; level_index > 0; level_index--) {
-          que = std::move(search_layer_to_queue(item, entry_label, level_index, ef_construction_));
-          entry_label = (*que.begin()).second;
-          cur_level_edge = create_edge();
-
-          level_edges_[level_index - 1].emplace(label, cur_level_edge);
-
-          int m_neighbour = 0;
-          for (auto it = que.begin(); it != que.end() && m_neighbour < M_; it++, ++m_neighbour) {
-              neighbour_pair = (*it);
-              neighbour_edge = level_edges_[level_index - 1][neighbour_pair.second];
-              cur_level_edge->add_edge(neighbour_pair.first, neighbour_pair.second);
-              if (neighbour_edge->size() == M_max_) {
-                  int rm_label = neighbour_edge->remove_further(neighbour_pair.first, label);
-                  neighbour_edge = level_edges_[level_index - 1][rm_label];
-                  neighbour_edge->remove(neighbour_pair.second);
-              } else {
-                  neighbour_edge->add_edge(neighbour_pair.first, label);
-              }
+  uint32_t hnsw<vec_t>::store(const vec_t *item, idx_t label) {
+      auto id = static_cast<uint32_t>(labels_.size());
+      int level = std::min(get_random_level(mult_), static_cast<int>(std::numeric_limits<uint8_t>::max()));
+
+      labels_.push_back(label);
+      label_map_.emplace(label, id);
+      levels_.push_back(static_cast<uint8_t>(level));
+      vectors_.resize((id + 1) * vec_stride_);
+      level0_.resize((id + 1) * link_stride_);
+      upper_links_.emplace_back(level * link_stride_, 0);
+
+      vec_t *p = vectors_.data() + id * vec_stride_;
+      std::copy(item, item + dim, p);
+      if (type_ == COSINE) {
+          norms_.push_back(normalize(p, dim));
+      }
+      if (quantized_) {
+          codes_.resize((id + 1) * code_stride_);
+          encode(id);
+      }
+      return id;
+  }
+
+  template<typename vec_t>
+  void hnsw<vec_t>::link(uint32_t id) {
+      const vec_t *p = point(id);
+      int level = levels_[id];
+
+      std::unique_lock<std::mutex> top_lock(entry_mutex_, std::defer_lock);
+      if (level > max_level_.load(std::memory_order_acquire)) {
+          top_lock.lock();
+          if (level <= max_level_.load(std::memory_order_acquire)) {
+              top_lock.unlock();
           }
+      }
 
+      // the entry is read before its level, a concurrent raise publishes both together under the entry lock
+      auto entry = entry_.load(std::memory_order_acquire);
+      if (max_level_.load(std::memory_order_acquire) < 0) {
+          entry_.store(id, std::memory_order_release);
+          max_level_.store(level, std::memory_order_release);
+          return;
       }
+      int max_level = levels_[entry];
 
-      if (random_level > max_level_) {
-          max_level_ = random_level;
-          entry_label_ = label;
+      for (auto l = max_level; l > level; l--) {
+          entry = search_layer_down(ExactDistance{this, p}, entry, l);
       }
 
+      // every level of the point is written before any neighbour links back to it, so a concurrent insert that
+      // reaches the point through a reverse edge never finds one of its lists still empty
+      int top = std::min(level, max_level);
+      std::vector<std::vector<dis_id_pair>> neighbours(top + 1);
+      auto state = visited_pool_.get(labels_.size());
+      for (auto l = top; l >= 0; l--) {
+          neighbours[l] = search_layer_to_queue(ExactDistance{this, p}, entry, l, ef_construction_, *state);
+          entry = neighbours[l].front().second;
+          connect(id, neighbours[l], l);
+      }
+      for (auto l = top; l >= 0; l--) {
+          connect_back(id, neighbours[l], l);
+      }
+
+      if (top_lock.owns_lock()) {
+          entry_.store(id, std::memory_order_release);
+          max_level_.store(level, std::memory_order_release);
+      }
+  }
+
+  template<typename vec_t>
+  void hnsw<vec_t>::insert(const vec_t *item, idx_t label) {
+      link(store(item, label));
   }
 
   template<typename vec_t>
-  std::vector<int> hnsw<vec_t>::query(const vec_t *query, int k) {
-      std::vector<int> res;
-      res.reserve(k);
-      if (max_level_) {
-          int entry_label = entry_label_;
-          for (auto level = max_level_; level > 1; level--) {
-              entry_label = search_layer_down(query, entry_label, level);
+  Status hnsw<vec_t>::build() {
+      if (pending_.empty()) {
+          return Status::OK();
+      }
+
+      // the first point of an empty graph becomes the entry the others start from
+      size_t begin = 0;
+      if (max_level_.load() < 0) {
+          link(pending_[begin++]);
+      }
+
+      concurrent_ = true;
+      parallel_for(executor_, pending_.size() - begin, kBuildGrain, [&](size_t first, size_t last, size_t) {
+          for (size_t i = first; i < last; ++i) {
+              link(pending_[begin + i]);
           }
-          auto que = std::move(search_layer_to_queue(query, entry_label, 1, ef_construction_));
-          for (auto it = que.begin(); it != que.end() && k > 0; it++, k--) {
-              res.emplace_back((*it).second);
+      });
+      concurrent_ = false;
+
+      pending_.clear();
+      return Status::OK();
+  }
+
+  template<typename vec_t>
+  Status hnsw<vec_t>::quantize() {
+      auto n = static_cast<uint32_t>(labels_.size());
+      sq_minmax_ = Minmax<vec_t>();
+      for (uint32_t id = 0; id < n; ++id) {
+          const vec_t *p = point(id);
+          for (int i = 0; i < dim; ++i) {
+              sq_minmax_.min_val = std::min(sq_minmax_.min_val, p[i]);
+              sq_minmax_.max_val = std::max(sq_minmax_.max_val, p[i]);
           }
       }
-      return std::move(res);
+      sq_diff_ = static_cast<double>(sq_minmax_.max_val) - sq_minmax_.min_val;
+      if (!(sq_diff_ > 0)) {
+          sq_diff_ = 1;
+      }
+      sq_scale_ = static_cast<float>(sq_diff_ / code_range<int8_t>() / 2.0);
+      sq_offset_ = static_cast<float>(sq_diff_ / 2.0 + sq_minmax_.min_val);
+
+      codes_.assign(static_cast<size_t>(n) * code_stride_, 0);
+      for (uint32_t id = 0; id < n; ++id) {
+          encode(id);
+      }
+      quantized_ = true;
+      return Status::OK();
   }
 
   template<typename vec_t>
-  void hnsw<vec_t>::query(const vec_t *query, int k, std::vector<idx_t> *res) {
-      res->reserve(k);
-      if (max_level_) {
-          int entry_label = entry_label_;
-          for (auto level = max_level_; level > 1; level--) {
-              entry_label = search_layer_down(query, entry_label, level);
+  Status hnsw<vec_t>::reorder() {
+      build();
+      auto n = static_cast<uint32_t>(labels_.size());
+      if (n == 0) {
+          return Status::OK();
+      }
+
+      constexpr uint32_t kUnset = std::numeric_limits<uint32_t>::max();
+      std::vector<uint32_t> order;
+      std::vector<uint32_t> new_id(n, kUnset);
+      std::vector<uint32_t> next;
+      order.reserve(n);
+
+      // points unreachable from the entry start breadth first searches of their own
+      uint32_t start = entry_.load();
+      uint32_t scan = 0;
+      while (order.size() < n) {
+          if (new_id[start] != kUnset) {
+              while (new_id[scan] != kUnset) {
+                  ++scan;
+              }
+              start = scan;
+          }
+          new_id[start] = static_cast<uint32_t>(order.size());
+          order.push_back(start);
+          for (size_t head = order.size() - 1; head < order.size(); ++head) {
+              const uint32_t *l = links(order[head], 0);
+              next.assign(l + 1, l + 1 + l[0]);
+              std::sort(next.begin(), next.end(), [this](uint32_t a, uint32_t b) {
+                  return links(a, 0)[0] < links(b, 0)[0];
+              });
+              for (auto v: next) {
+                  if (new_id[v] == kUnset) {
+                      new_id[v] = static_cast<uint32_t>(order.size());
+                      order.push_back(v);
+                  }
+              }
+          }
+      }
+
+      auto remap = [&new_id](uint32_t *l) {
+          for (uint32_t j = 1; j <= l[0]; ++j) {
+              l[j] = new_id[l[j]];
+          }
+      };
+
+      decltype(vectors_) vectors(vectors_.size());
+      decltype(level0_) level0(level0_.size());
+      std::vector<std::vector<uint32_t>> upper_links(n);
+      std::vector<uint8_t> levels(n);
+      std::vector<idx_t> labels(n);
+      std::vector<float> norms(norms_.size());
+      decltype(codes_) codes(codes_.size());
+      for (uint32_t i = 0; i < n; ++i) {
+          uint32_t old = order[i];
+          std::copy(point(old), point(old) + vec_stride_, vectors.data() + i * vec_stride_);
+          if (quantized_) {
+              std::copy(code(old), code(old) + code_stride_, codes.data() + i * code_stride_);
+          }
+
+          const uint32_t *l = links(old, 0);
+          uint32_t *l0 = level0.data() + i * link_stride_;
+          std::copy(l, l + 1 + l[0], l0);
+          remap(l0);
+
+          upper_links[i] = std::move(upper_links_[old]);
+          for (int level = 0; level < levels_[old]; ++level) {
+              remap(upper_links[i].data() + level * link_stride_);
+          }
+
+          levels[i] = levels_[old];
+          labels[i] = labels_[old];
+          label_map_[labels[i]] = i;
+          if (type_ == COSINE) {
+              norms[i] = norms_[old];
           }
-          auto que = std::move(search_layer_to_queue(query, entry_label, 1, ef_construction_));
-          for (auto it = que.begin(); it != que.end() && k > 0; it++, k--) {
-              res->emplace_back((*it).second);
+      }
+
+      vectors_.swap(vectors);
+      level0_.swap(level0);
+      upper_links_.swap(upper_links);
+      levels_.swap(levels);
+      labels_.swap(labels);
+      norms_.swap(norms);
+      codes_.swap(codes);
+      entry_.store(new_id[entry_.load()]);
+      return Status::OK();
+  }
+
+  template<typename vec_t>
+  std::vector<idx_t> hnsw<vec_t>::query(const vec_t *query, int k) const {
+      std::vector<idx_t> res;
+      this->query(query, k, &res);
+      return res;
+  }
+
+  template<typename vec_t>
+  void hnsw<vec_t>::query(const vec_t *query, int k, std::vector<idx_t> *res) const {
+      auto state = visited_pool_.get(labels_.size());
+      query = prepare_query(type_, query, dim, state->normalized);
+
+      auto &que = search_base(query, std::max(ef_search_, k), *state);
+      res->reserve(res->size() + k);
+      for (auto it = que.begin(); it != que.end() && k > 0; it++, k--) {
+          res->emplace_back(labels_[(*it).second]);
+      }
+  }
+
+  template<typename vec_t>
+  Status hnsw<vec_t>::search(const vec_t *query_vec, size_t k, std::vector<idx_t> &result_ids,
+                             std::vector<float> &result_distances) const {
+      auto state = visited_pool_.get(labels_.size());
+      query_vec = prepare_query(type_, query_vec, dim, state->normalized);
+
+      auto &que = search_base(query_vec, std::max<int>(ef_search_, static_cast<int>(k)), *state);
+      auto n = std::min(k, que.size());
+      result_ids.resize(n);
+      result_distances.resize(n);
+      for (size_t i = 0; i < n; ++i) {
+          result_ids[i] = labels_[que[i].second];
+          // |a - b|^2 = 2 - 2 cos between unit vectors, inner products are ranked negated
+          if (type_ == COSINE) {
+              result_distances[i] = 1 - que[i].first / 2;
+          } else {
+              result_distances[i] = type_ == IP ? -que[i].first : que[i].first;
           }
       }
+      return Status::OK();
   }
 
-}
\ No newline at end of file
+}
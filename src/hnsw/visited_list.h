@@ -0,0 +1,118 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace alp::hnsw {
+
+  // Visited marks of one graph search. A point counts as visited when its tag equals the current epoch, so a
+  // reset only bumps the epoch and the tags are cleared once every 65535 resets when it wraps around.
+  class VisitedList {
+  public:
+      using tag_t = uint16_t;
+
+      explicit VisitedList(size_t n) : tags_(n, 0) {
+      }
+
+      size_t capacity() const {
+          return tags_.size();
+      }
+
+      // new points start unvisited as the epoch is never 0
+      void resize(size_t n) {
+          tags_.resize(n, 0);
+      }
+
+      void reset() {
+          if (++epoch_ == 0) {
+              std::fill(tags_.begin(), tags_.end(), 0);
+              epoch_ = 1;
+          }
+      }
+
+      // marks id and returns whether it was unvisited
+      bool visit(uint32_t id) {
+          bool fresh = tags_[id] != epoch_;
+          tags_[id] = epoch_;
+          return fresh;
+      }
+
+      bool visited(uint32_t id) const {
+          return tags_[id] == epoch_;
+      }
+
+      void prefetch(uint32_t id) const {
+          __builtin_prefetch(tags_.data() + id);
+      }
+
+  private:
+      std::vector<tag_t> tags_;
+      tag_t epoch_ = 0;
+  };
+
+  // Searches check a list out and hand it back when the handle goes away, once every thread has one the query
+  // path does not allocate. List is VisitedList or a type derived from it that adds the other buffers a search
+  // reuses.
+  template<typename List = VisitedList>
+  class VisitedListPool {
+  public:
+      class Handle {
+      public:
+          Handle(VisitedListPool &pool, std::unique_ptr<List> list) : pool_(pool), list_(std::move(list)) {
+          }
+
+          Handle(const Handle &) = delete;
+
+          Handle &operator=(const Handle &) = delete;
+
+          ~Handle() {
+              pool_.release(std::move(list_));
+          }
+
+          List *operator->() const {
+              return list_.get();
+          }
+
+          List &operator*() const {
+              return *list_;
+          }
+
+      private:
+          VisitedListPool &pool_;
+          std::unique_ptr<List> list_;
+      };
+
+      // a reset list covering at least n points
+      Handle get(size_t n) {
+          std::unique_ptr<List> list;
+          {
+              std::lock_guard<std::mutex> lock(mutex_);
+              if (!free_.empty()) {
+                  list = std::move(free_.back());
+                  free_.pop_back();
+              }
+          }
+
+          if (!list) {
+              list = std::make_unique<List>(n);
+          } else if (list->capacity() < n) {
+              list->resize(n);
+          }
+          list->reset();
+          return {*this, std::move(list)};
+      }
+
+  private:
+      void release(std::unique_ptr<List> list) {
+          std::lock_guard<std::mutex> lock(mutex_);
+          free_.push_back(std::move(list));
+      }
+
+      std::mutex mutex_;
+      std::vector<std::unique_ptr<List>> free_;
+  };
+
+}
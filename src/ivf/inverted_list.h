@@ -0,0 +1,198 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "utils/aligned_allocator.h"
+
+namespace alp::ivf {
+
+  // One inverted list stored as a structure of arrays: the codes of all rows back to back in a single 64 byte
+  // aligned array and their ids in a parallel array, so a scan streams both linearly.
+  template<typename T>
+  class InvertedList {
+  public:
+      using idx_t = int64_t;
+
+      explicit InvertedList(size_t code_size = 0) : code_size_(code_size) {
+      }
+
+      size_t size() const {
+          return ids_.size();
+      }
+
+      bool empty() const {
+          return ids_.empty();
+      }
+
+      size_t code_size() const {
+          return code_size_;
+      }
+
+      void add(const T *code, idx_t id) {
+          grow(size() + 1);
+          codes_.insert(codes_.end(), code, code + code_size_);
+          ids_.push_back(id);
+      }
+
+      // appends a row and returns its code for the caller to fill in
+      T *append(idx_t id) {
+          grow(size() + 1);
+          codes_.resize(codes_.size() + code_size_);
+          ids_.push_back(id);
+          return codes_.data() + codes_.size() - code_size_;
+      }
+
+      const T *codes() const {
+          return codes_.data();
+      }
+
+      const T *code(size_t i) const {
+          return codes_.data() + i * code_size_;
+      }
+
+      const idx_t *ids() const {
+          return ids_.data();
+      }
+
+      idx_t id(size_t i) const {
+          return ids_[i];
+      }
+
+      void reserve(size_t n) {
+          codes_.reserve(n * code_size_);
+          ids_.reserve(n);
+      }
+
+      void clear() {
+          codes_.clear();
+          ids_.clear();
+      }
+
+      void shrink_to_fit() {
+          codes_.shrink_to_fit();
+          ids_.shrink_to_fit();
+      }
+
+  private:
+      // capacity grows by half its size, rounded up to whole chunks of rows
+      static constexpr size_t kChunk = 256;
+
+      void grow(size_t n) {
+          if (n <= ids_.capacity()) {
+              return;
+          }
+          size_t capacity = std::max(n, ids_.capacity() + ids_.capacity() / 2);
+          reserve((capacity + kChunk - 1) / kChunk * kChunk);
+      }
+
+      size_t code_size_;
+      std::vector<T, AlignedAllocator<T>> codes_;
+      std::vector<idx_t> ids_;
+  };
+
+  // 4-bit product quantizer codes packed for fast scan. Rows are grouped in blocks of 32 and a block stores 16
+  // bytes per sub quantizer, sub quantizers 2p and 2p + 1 side by side: byte j holds the code of row j in its low
+  // nibble and the code of row j + 16 in its high nibble. An odd last sub quantizer is padded with zero codes.
+  class PackedInvertedList {
+  public:
+      using idx_t = int64_t;
+
+      static constexpr size_t kBlockRows = 32;
+
+      explicit PackedInvertedList(size_t m) : m_(m), pairs_((m + 1) / 2) {
+      }
+
+      size_t size() const {
+          return ids_.size();
+      }
+
+      bool empty() const {
+          return ids_.empty();
+      }
+
+      size_t pairs() const {
+          return pairs_;
+      }
+
+      size_t block_num() const {
+          return (size() + kBlockRows - 1) / kBlockRows;
+      }
+
+      size_t block_bytes() const {
+          return pairs_ * kBlockRows;
+      }
+
+      const uint8_t *block(size_t b) const {
+          return codes_.data() + b * block_bytes();
+      }
+
+      // code holds one 4-bit code per byte
+      void add(const uint8_t *code, idx_t id) {
+          size_t row = size();
+          if (row % kBlockRows == 0) {
+              grow(block_num() + 1);
+              codes_.resize(codes_.size() + block_bytes(), 0);
+          }
+          uint8_t *blk = codes_.data() + row / kBlockRows * block_bytes();
+          size_t j = row % kBlockRows;
+          for (size_t q = 0; q < m_; ++q) {
+              uint8_t &byte = blk[offset(q, j)];
+              byte |= j < 16 ? (code[q] & 0x0F) : (code[q] & 0x0F) << 4;
+          }
+          ids_.push_back(id);
+      }
+
+      // unpacks the code of a row into one byte per sub quantizer
+      void code(size_t row, uint8_t *out) const {
+          const uint8_t *blk = block(row / kBlockRows);
+          size_t j = row % kBlockRows;
+          for (size_t q = 0; q < m_; ++q) {
+              uint8_t byte = blk[offset(q, j)];
+              out[q] = j < 16 ? byte & 0x0F : byte >> 4;
+          }
+      }
+
+      const idx_t *ids() const {
+          return ids_.data();
+      }
+
+      idx_t id(size_t i) const {
+          return ids_[i];
+      }
+
+      void reserve(size_t n) {
+          codes_.reserve((n + kBlockRows - 1) / kBlockRows * block_bytes());
+          ids_.reserve(n);
+      }
+
+      void clear() {
+          codes_.clear();
+          ids_.clear();
+      }
+
+  private:
+      static constexpr size_t kChunkBlocks = 8;
+
+      static size_t offset(size_t q, size_t j) {
+          return q / 2 * kBlockRows + q % 2 * 16 + j % 16;
+      }
+
+      void grow(size_t blocks) {
+          if (blocks * block_bytes() <= codes_.capacity()) {
+              return;
+          }
+          size_t capacity = std::max(blocks, codes_.capacity() / block_bytes() * 3 / 2);
+          capacity = (capacity + kChunkBlocks - 1) / kChunkBlocks * kChunkBlocks;
+          codes_.reserve(capacity * block_bytes());
+          ids_.reserve(capacity * kBlockRows);
+      }
+
+      size_t m_;
+      size_t pairs_;
+      std::vector<uint8_t, AlignedAllocator<uint8_t>> codes_;
+      std::vector<idx_t> ids_;
+  };
+
+}
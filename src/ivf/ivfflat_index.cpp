@@ -1,5 +1,7 @@
 #include "ivfflat_index.h"
 
+#include <algorithm>
+
 namespace alp::ivf {
   template<typename vec_t>
   Status IvfIndex<vec_t>::build() {
@@ -9,75 +11,238 @@ namespace alp::ivf {
 
       is_inited_ = true;
 
+      auto dim = header_.dim_;
+      auto n = ids_.size();
+      for (size_t i = 0; i < n; ++i) {
+          kmeans_.add(vectors_.data() + i * dim);
+      }
+      kmeans_.set_executor(executor_);
       kmeans_.train();
 
       auto ce = kmeans_.centroids();
       auto cluster_num = ce.size();
-      auto dim = header_.dim_;
 
       kmeans_.clear();
 
-      {
-          auto ce_cp = ce;
-          ivf_clusters_.reserve(ce_cp.size());
-          for (size_t i = 0; i < ce_cp.size(); ++i) {
-              ivf_clusters_.add_cluster(std::move(ce_cp), header_.cluster_type_);
+      centroids_.clear();
+      centroids_.reserve(cluster_num * dim);
+      for (const auto &c: ce) {
+          centroids_.insert(centroids_.end(), c.begin(), c.end());
+      }
+
+      ivf_clusters_.reserve(cluster_num);
+      for (auto &c: ce) {
+          ivf_clusters_.add_cluster(std::move(c), header_.cluster_type_);
+      }
+
+      coarse_.set_base(centroids_.data(), cluster_num);
+      // only L2 indexes accept the graph, it ranks by the same metric as coarse_
+      if (hnsw_M_ > 0) {
+          coarse_hnsw_ = std::make_unique<hnsw::hnsw<vec_t>>(hnsw_M_, 2 * hnsw_M_, hnsw_ef_construction_,
+                                                             hnsw_ef_search_, dim, L2);
+          coarse_hnsw_->set_executor(executor_);
+          for (size_t c = 0; c < cluster_num; ++c) {
+              coarse_hnsw_->add(static_cast<idx_t>(c), centroids_.data() + c * dim);
           }
+          coarse_hnsw_->build();
+          // later queries only search the graph
+          coarse_hnsw_->set_executor(nullptr);
       }
 
+      // Every chunk of rows is assigned in parallel and counts its rows per list. A prefix sum over the lists and
+      // then the chunks gives every chunk its slot in each list, so the rows are scattered into one array grouped
+      // by list in insertion order.
+      size_t workers = parallel_workers(executor_, n, kAssignGrain);
+      size_t grain = std::max(kAssignGrain, (n + workers - 1) / workers);
+      size_t chunks = (n + grain - 1) / grain;
+      std::vector<idx_t> labels(n);
+      std::vector<size_t> slots(chunks * cluster_num, 0);
+      parallel_for(executor_, n, grain, [&](size_t begin, size_t end, size_t) {
+          std::vector<float> dis(end - begin);
+          assign(vectors_.data() + begin * dim, end - begin, 1, labels.data() + begin, dis.data());
+          size_t *count = slots.data() + begin / grain * cluster_num;
+          for (size_t i = begin; i < end; ++i) {
+              count[labels[i]]++;
+          }
+      });
 
-      for (const auto &data: datas_) {
-          float min_dis = std::numeric_limits<float>::max();
-          int min_index = -1;
-          for (size_t i = 0; i < cluster_num; ++i) {
-              auto &c = ce[i];
-              auto dis = calc_(data.second.data.data(), c.data(), dim);
-              if (dis < min_dis) {
-                  min_dis = dis;
-                  min_index = static_cast<int>(i);
-              }
+      // the rows of list c are rows[list_offsets[c]] .. rows[list_offsets[c + 1] - 1]
+      std::vector<size_t> list_offsets(cluster_num + 1, 0);
+      for (size_t c = 0; c < cluster_num; ++c) {
+          size_t offset = list_offsets[c];
+          for (size_t chunk = 0; chunk < chunks; ++chunk) {
+              size_t count = slots[chunk * cluster_num + c];
+              slots[chunk * cluster_num + c] = offset;
+              offset += count;
           }
-          ivf_clusters_[min_index]->add(data.second.data.data(), data.first, dim);
+          list_offsets[c + 1] = offset;
       }
+      std::vector<uint32_t> rows(n);
+      parallel_for(executor_, n, grain, [&](size_t begin, size_t end, size_t) {
+          size_t *slot = slots.data() + begin / grain * cluster_num;
+          for (size_t i = begin; i < end; ++i) {
+              rows[slot[labels[i]]++] = static_cast<uint32_t>(i);
+          }
+      });
 
+      // lists are filled and encoded independently, one cluster at a time per worker
+      bool cosine = header_.distance_type_ == COSINE;
+      list_norms_.resize(cosine ? cluster_num : 0);
+      parallel_for(executor_, cluster_num, 1, [&](size_t begin, size_t end, size_t) {
+          for (size_t c = begin; c < end; ++c) {
+              auto &cluster = ivf_clusters_[c];
+              cluster->reserve(list_offsets[c + 1] - list_offsets[c]);
+              for (size_t r = list_offsets[c]; r < list_offsets[c + 1]; ++r) {
+                  cluster->add(vectors_.data() + rows[r] * dim, ids_[rows[r]], dim);
+                  if (cosine) {
+                      list_norms_[c].push_back(norms_[rows[r]]);
+                  }
+              }
+              cluster->train();
+          }
+      });
+
+      // the lists hold every vector from here on
+      if (cluster_num > 0) {
+          std::vector<vec_t>().swap(vectors_);
+          std::vector<idx_t>().swap(ids_);
+          std::vector<float>().swap(norms_);
+      }
+      return Status::OK();
   }
 
 
   template<typename vec_t>
   Status IvfIndex<vec_t>::search(const vec_t *query_vec, size_t k, std::vector<idx_t> &result_ids,
                                  std::vector<float> &result_distances) const {
-      using wrap = std::pair<float, size_t>;
-
-      bounded_priority_queue<wrap, std::greater<>> queue(header_.probes_);
-      auto size = ivf_clusters_.size();
       auto dim = header_.dim_;
-      auto dis_type = header_.distance_type_;
+      auto dis_type = scan_distance_type(static_cast<DistanceType>(header_.distance_type_));
+
+      std::vector<vec_t> normalized;
+      query_vec = prepare_query(static_cast<DistanceType>(header_.distance_type_), query_vec, dim, normalized);
+
+      std::vector<idx_t> probes(header_.probes_);
+      std::vector<float> probe_dis(header_.probes_);
+      assign(query_vec, 1, header_.probes_, probes.data(), probe_dis.data());
+
+      using predict_type = typename IvfCluster<vec_t>::predict_type;
+      predict_type result_queue(k);
 
-      for (size_t i = 0; i < size; ++i) {
-          auto &cluster = ivf_clusters_[i];
-          auto dis = calc_(query_vec, cluster->centroid().data(), dim);
-          queue.push({dis, i});
+      size_t probe_num = std::find(probes.begin(), probes.end(), -1) - probes.begin();
+      if (parallel_probe_ && executor_ != nullptr && probe_num > 1) {
+          // every worker keeps its own top k over the lists it scans, they are merged once all are done
+          std::vector<predict_type> partials(parallel_workers(executor_, probe_num, 1), predict_type(k));
+          parallel_for(executor_, probe_num, 1, [&](size_t begin, size_t end, size_t worker) {
+              for (size_t i = begin; i < end; ++i) {
+                  auto partial = ivf_clusters_[probes[i]]->predict(k, query_vec, dim, dis_type);
+                  partials[worker].merge(partial);
+              }
+          });
+          for (auto &partial: partials) {
+              result_queue.merge(partial);
+          }
+      } else {
+          for (size_t i = 0; i < probe_num; ++i) {
+              auto partial = ivf_clusters_[probes[i]]->predict(k, query_vec, dim, dis_type);
+              result_queue.merge(partial);
+          }
       }
 
-      bounded_priority_queue<predict_result, std::greater<>> result_queue(k);
+      result_ids.resize(result_queue.size());
+      result_distances.resize(result_queue.size());
+      dump_results(result_queue, dis_type, result_ids.data(), result_distances.data());
 
-      for (size_t i = 0; i < header_.probes_; ++i) {
-          auto &cluster = ivf_clusters_[queue.top().second];
+      return Status::OK();
+  }
 
-          result_queue.merge(cluster->predict(k, query_vec, dim, dis_type));
+  template<typename vec_t>
+  Status IvfIndex<vec_t>::search_batch(size_t n, const vec_t *queries, size_t k, std::vector<idx_t> &result_ids,
+                                       std::vector<float> &result_distances) const {
+      auto dim = header_.dim_;
+      auto type = static_cast<DistanceType>(header_.distance_type_);
+      auto dis_type = scan_distance_type(type);
+      size_t nprobe = header_.probes_;
+
+      std::vector<vec_t> normalized;
+      if (type == COSINE) {
+          normalized.assign(queries, queries + n * dim);
+          for (size_t i = 0; i < n; ++i) {
+              normalize(normalized.data() + i * dim, dim);
+          }
+          queries = normalized.data();
       }
 
-      result_ids.clear();
-      result_distances.clear();
+      std::vector<idx_t> probes(n * nprobe);
+      std::vector<float> probe_dis(n * nprobe);
+      assign(queries, n, nprobe, probes.data(), probe_dis.data());
+
+      // the queries probing list c are groups[offsets[c]] .. groups[offsets[c + 1] - 1]
+      size_t cluster_num = ivf_clusters_.size();
+      std::vector<size_t> offsets(cluster_num + 1, 0);
+      for (auto probe: probes) {
+          if (probe >= 0) {
+              offsets[probe + 1]++;
+          }
+      }
+      for (size_t c = 0; c < cluster_num; ++c) {
+          offsets[c + 1] += offsets[c];
+      }
+      std::vector<uint32_t> groups(offsets.back());
+      {
+          auto fill = offsets;
+          for (size_t i = 0; i < probes.size(); ++i) {
+              if (probes[i] >= 0) {
+                  groups[fill[probes[i]]++] = static_cast<uint32_t>(i / nprobe);
+              }
+          }
+      }
+
+      // workers own a queue per query, lists are handed out one at a time
+      using predict_type = typename IvfCluster<vec_t>::predict_type;
+      size_t workers = parallel_workers(executor_, cluster_num, 1);
+      std::vector<predict_type> queues(workers * n, predict_type(k));
+      parallel_for(executor_, cluster_num, 1, [&](size_t begin, size_t end, size_t worker) {
+          std::vector<const vec_t *> group_queries;
+          std::vector<predict_type *> group_queues;
+          for (size_t c = begin; c < end; ++c) {
+              if (offsets[c] == offsets[c + 1]) {
+                  continue;
+              }
+              group_queries.clear();
+              group_queues.clear();
+              for (size_t g = offsets[c]; g < offsets[c + 1]; ++g) {
+                  group_queries.push_back(queries + groups[g] * dim);
+                  group_queues.push_back(&queues[worker * n + groups[g]]);
+              }
+              ivf_clusters_[c]->predict_batch(k, group_queries.data(), group_queries.size(), dim, dis_type,
+                                              group_queues.data());
+          }
+      });
 
-      for (const auto &r: result_queue.dump()) {
-          result_ids.push_back(r.id);
-          result_distances.push_back(r.dis);
+      result_ids.assign(n * k, -1);
+      result_distances.assign(n * k, ordered_distance(dis_type, std::numeric_limits<float>::max()));
+      for (size_t q = 0; q < n; ++q) {
+          for (size_t w = 1; w < workers; ++w) {
+              queues[q].merge(queues[w * n + q]);
+          }
+          dump_results(queues[q], dis_type, result_ids.data() + q * k, result_distances.data() + q * k);
       }
 
       return Status::OK();
   }
 
+  template<typename vec_t>
+  void IvfIndex<vec_t>::dump_results(typename IvfCluster<vec_t>::predict_type &queue, DistanceType type,
+                                     idx_t *ids, float *distances) {
+      // the queue pops the furthest first
+      auto results = queue.dump();
+      for (size_t i = 0; i < results.size(); ++i) {
+          const auto &r = results[results.size() - 1 - i];
+          ids[i] = r.id;
+          distances[i] = ordered_distance(type, r.dis);
+      }
+  }
+
   template<typename vec_t>
   size_t IvfIndex<vec_t>::dimension() const {
       return header_.dim_;
@@ -85,22 +250,166 @@ namespace alp::ivf {
 
   template<typename vec_t>
   size_t IvfIndex<vec_t>::size() const {
-      return datas_.size();
+      return vector_num_;
+  }
+
+  template<typename vec_t>
+  IvfIndex<vec_t>::IvfIndex(ClusterType c_type, int lists, int probes, int dim, DistanceType type, int threads)
+          : header_{lists, probes, dim, static_cast<int>(type), c_type}, calc_{scan_distance_type(type), dim},
+            coarse_(scan_distance_type(type), dim), kmeans_(lists, dim) {
+      kmeans_.set_max_points_per_centroid(kTrainPointsPerList);
+      if (threads > 1) {
+          owned_executor_ = std::make_unique<Executor>(threads - 1);
+          executor_ = owned_executor_.get();
+      }
+  }
+
+  template<typename vec_t>
+  void IvfIndex<vec_t>::set_executor(Executor *executor) {
+      executor_ = executor;
+  }
+
+  template<typename vec_t>
+  void IvfIndex<vec_t>::set_training_sample(size_t points_per_list) {
+      kmeans_.set_max_points_per_centroid(points_per_list);
+  }
+
+  template<typename vec_t>
+  void IvfIndex<vec_t>::set_mini_batch(size_t batch_size) {
+      kmeans_.set_mini_batch(batch_size);
   }
 
   template<typename vec_t>
-  IvfIndex<vec_t>::IvfIndex(int lists, int probes, int dim, DistanceType type, ClusterType c_type)
-          : header_{lists, probes, dim, type, c_type}, calc_{type}, kmeans_(lists, dim) {
+  Status IvfIndex<vec_t>::set_balanced_lists(double max_ratio) {
+      if (max_ratio != 0 && !(max_ratio > 1)) {
+          return Status::InvalidArgument();
+      }
+      kmeans_.set_balance(max_ratio);
+      return Status::OK();
+  }
+
+  template<typename vec_t>
+  void IvfIndex<vec_t>::set_parallel_probe(bool enable) {
+      parallel_probe_ = enable;
+  }
+
+  template<typename vec_t>
+  Status IvfIndex<vec_t>::use_hnsw_quantizer(int M, int ef_construction, int ef_search) {
+      if (header_.distance_type_ != L2) {
+          return Status::InvalidArgument();
+      }
+      hnsw_M_ = M;
+      hnsw_ef_construction_ = ef_construction;
+      hnsw_ef_search_ = ef_search;
+      return Status::OK();
+  }
+
+  template<typename vec_t>
+  void IvfIndex<vec_t>::set_quantizer_ef(int ef) {
+      hnsw_ef_search_ = ef;
+      if (coarse_hnsw_) {
+          coarse_hnsw_->set_ef(ef);
+      }
+  }
+
+  template<typename vec_t>
+  void IvfIndex<vec_t>::assign(const vec_t *x, size_t n, size_t nprobe, idx_t *labels, float *dis) const {
+      if (!coarse_hnsw_) {
+          if (nprobe == 1) {
+              coarse_.nearest(x, n, labels, dis);
+          } else {
+              coarse_.knn(x, n, nprobe, labels, dis);
+          }
+          return;
+      }
+
+      std::fill_n(labels, n * nprobe, -1);
+      std::fill_n(dis, n * nprobe, std::numeric_limits<float>::max());
+      std::vector<idx_t> ids;
+      std::vector<float> distances;
+      for (size_t i = 0; i < n; ++i) {
+          coarse_hnsw_->search(x + i * header_.dim_, nprobe, ids, distances);
+          std::copy(ids.begin(), ids.end(), labels + i * nprobe);
+          std::copy(distances.begin(), distances.end(), dis + i * nprobe);
+      }
   }
 
 
   template<typename vec_t>
   Status IvfIndex<vec_t>::add(idx_t id, const vec_t *vec_ptr) {
-      auto dt = data_type<vec_t>(vec_ptr, vec_ptr + header_.dim_, id);
-      kmeans_.add(dt.data.begin());
-      datas_.emplace(id, data_type<vec_t>(vec_ptr, vec_ptr + header_.dim_, id));
+      auto dim = header_.dim_;
+      vector_num_++;
+      bool cosine = header_.distance_type_ == COSINE;
+
+      // before build vectors are staged for training, after it they go straight to the list of their closest
+      // centroid
+      if (!is_inited_ || centroids_.empty()) {
+          ids_.push_back(id);
+          vectors_.insert(vectors_.end(), vec_ptr, vec_ptr + dim);
+          if (cosine) {
+              norms_.push_back(normalize(vectors_.data() + vectors_.size() - dim, dim));
+          }
+          return Status::OK();
+      }
+
+      std::vector<vec_t> normalized;
+      float norm = 1;
+      if (cosine) {
+          normalized.assign(vec_ptr, vec_ptr + dim);
+          norm = normalize(normalized.data(), dim);
+          vec_ptr = normalized.data();
+      }
+      idx_t label;
+      float dis;
+      assign(vec_ptr, 1, 1, &label, &dis);
+      ivf_clusters_[label]->add(vec_ptr, id, dim);
+      if (cosine) {
+          list_norms_[label].push_back(norm);
+      }
       return Status::OK();
   }
 
+  template<typename vec_t>
+  Status IvfIndex<vec_t>::add(const vec_t *vec_ptr) {
+      return add(static_cast<idx_t>(vector_num_), vec_ptr);
+  }
+
+  template<typename vec_t>
+  Status IvfIndex<vec_t>::reconstruct(idx_t id, vec_t *vec_ptr) const {
+      auto dim = header_.dim_;
+      auto scale = [&](float norm) {
+          for (int i = 0; i < dim; ++i) {
+              vec_ptr[i] *= norm;
+          }
+      };
+
+      // a scan of the id arrays, the index keeps no map from ids to rows
+      if (auto it = std::find(ids_.begin(), ids_.end(), id); it != ids_.end()) {
+          size_t row = it - ids_.begin();
+          std::copy_n(vectors_.data() + row * dim, dim, vec_ptr);
+          if (!norms_.empty()) {
+              scale(norms_[row]);
+          }
+          return Status::OK();
+      }
+      for (size_t c = 0; c < ivf_clusters_.size(); ++c) {
+          const auto &cluster = ivf_clusters_[c];
+          const idx_t *ids = cluster->ids();
+          const idx_t *it = std::find(ids, ids + cluster->data_num(), id);
+          if (it == ids + cluster->data_num()) {
+              continue;
+          }
+          size_t row = it - ids;
+          if (!cluster->reconstruct(row, vec_ptr, dim)) {
+              return Status::NotSupported();
+          }
+          if (!list_norms_.empty()) {
+              scale(list_norms_[c][row]);
+          }
+          return Status::OK();
+      }
+      return Status::NotFound();
+  }
+
 
-}
+}
\ No newline at end of file
@@ -6,9 +6,12 @@
 #include "utils/quantizer.h"
 #include "utils/bounded_priority_queue.h"
 #include "utils/kmeans.h"
+#include "utils/pairwise_distance.h"
+#include "utils/executor.h"
+#include "hnsw/hnsw.h"
+#include "ivf/inverted_list.h"
 #include <cassert>
 #include <stdfloat>
-#include <unordered_map>
 
 
 namespace alp::ivf {
@@ -23,6 +26,8 @@ namespace alp::ivf {
       kSQ_FP16 = 3,
       kSQ_FP32 = 4,
       kSQ_BF16 = 5,
+      // 4-bit product quantizer scanned with in-register lookup tables
+      kPQ4 = 6,
   };
 
 
@@ -37,30 +42,30 @@ namespace alp::ivf {
 
   struct predict_result {
       idx_t id;
+      // smaller is closer, similarity scores are stored negated
       float dis;
-  };
 
-  template<typename T>
-  struct data_type {
-      data_type(const T *begin, const T *end, idx_t id) : id(id) {
-          data.reserve(end - begin);
-          data.insert(data.end(), begin, end);
+      bool operator<(const predict_result &other) const {
+          return dis < other.dis;
       }
-
-      data_type(std::vector<T> &&d, idx_t id) : data(std::move(d)), id(id) {}
-
-      std::vector<T> data;
-      idx_t id;
   };
 
+  // maps a score of the scan metric to the smaller is closer order of predict_result and back again
+  static inline float ordered_distance(DistanceType type, float dis) {
+      return type == L2 ? dis : -dis;
+  }
+
 
   template<typename vec_t>
   struct IvfCluster {
       using idx_t = int64_t;
 
-      using predict_type = bounded_priority_queue<predict_result, std::greater<>>;
+      using predict_type = bounded_priority_queue<predict_result, std::less<>>;
 
       struct ClusterData {
+          explicit ClusterData(std::vector<vec_t> &&centroid) : centroid_(std::move(centroid)) {
+          }
+
           virtual size_t data_num() const = 0;
 
           virtual ClusterType type() const = 0;
@@ -71,9 +76,33 @@ namespace alp::ivf {
 
           virtual void add(const vec_t *vec_ptr, idx_t id, size_t dim) = 0;
 
+          // ids of the rows in list order, data_num() of them once trained
+          virtual const idx_t *ids() const = 0;
+
+          // copies the vector of a row as it was added to the list, false when the list only keeps lossy codes
+          virtual bool reconstruct(size_t row, vec_t *vec_ptr, size_t dim) const {
+              return false;
+          }
+
           virtual predict_type predict(int k, const vec_t *vec_ptr, size_t dim,
                                        DistanceType type = L2) = 0;
 
+          // scores the list against a group of queries, query i feeds queues[i]
+          virtual void predict_batch(int k, const vec_t *const *queries, size_t nq, size_t dim, DistanceType type,
+                                     predict_type *const *queues) {
+              for (size_t i = 0; i < nq; ++i) {
+                  auto partial = predict(k, queries[i], dim, type);
+                  queues[i]->merge(partial);
+              }
+          }
+
+          virtual void reserve(size_t size) {
+          }
+
+          // encodes the vectors added so far, called once all of them have been assigned
+          virtual void train() {
+          }
+
           virtual ~ClusterData() = default;
 
           std::vector<vec_t> centroid_;
@@ -81,44 +110,71 @@ namespace alp::ivf {
 
       template<typename T>
       struct ClusterDataT {
-          size_t data_num() const {
-              return datas_.size();
+          explicit ClusterDataT(size_t code_size) : list_(code_size) {
           }
 
-          void add(const vec_t *vec_ptr, idx_t id, size_t dim) {
-              datas_.emplace_back(vec_ptr, vec_ptr + dim, id);
+          size_t data_num() const {
+              return list_.size();
           }
 
-          void add(std::vector<T> &&d, idx_t id) {
-              datas_.emplace_back(std::move(d), id);
+          void add(const T *code, idx_t id) {
+              list_.add(code, id);
           }
 
           predict_type predict(int k, const vec_t *vec_ptr, size_t dim,
                                DistanceType type) {
-              bounded_priority_queue<predict_result, std::greater<>> queue(k);
+              predict_type queue(k);
+
+              DistanceCalc<vec_t> calc(type, dim);
 
-              DistanceCalc<vec_t> calc(type);
+              constexpr size_t kBatch = 256;
+              float dis[kBatch];
 
-              for (const auto &data: datas_) {
-                  auto dis = calc(vec_ptr, data.data.data(), dim);
-                  queue.push({data.id, dis});
+              for (size_t i = 0; i < list_.size(); i += kBatch) {
+                  auto n = std::min(kBatch, list_.size() - i);
+                  calc.batch(vec_ptr, list_.code(i), n, dim, dis);
+                  for (size_t j = 0; j < n; ++j) {
+                      queue.push({list_.id(i + j), ordered_distance(type, dis[j])});
+                  }
               }
               return queue;
           }
 
+          // rows are loaded a cache sized block at a time and the block is scored against every query
+          void predict_batch(const vec_t *const *queries, size_t nq, size_t dim, DistanceType type,
+                             predict_type *const *queues) {
+              DistanceCalc<vec_t> calc(type, dim);
+
+              size_t block = std::max<size_t>(kMinBlockRows, kBlockBytes / (dim * sizeof(T)));
+              std::vector<float> dis(block);
+
+              for (size_t i = 0; i < list_.size(); i += block) {
+                  auto n = std::min(block, list_.size() - i);
+                  for (size_t q = 0; q < nq; ++q) {
+                      calc.batch(queries[q], list_.code(i), n, dim, dis.data());
+                      for (size_t j = 0; j < n; ++j) {
+                          queues[q]->push({list_.id(i + j), ordered_distance(type, dis[j])});
+                      }
+                  }
+              }
+          }
+
           void reserve(size_t size) {
-              datas_.reserve(size);
+              list_.reserve(size);
           }
 
           void clear() {
-              datas_.clear();
+              list_.clear();
           }
 
-          std::vector<data_type<T>> datas_;
+          static constexpr size_t kBlockBytes = 64 * 1024;
+          static constexpr size_t kMinBlockRows = 16;
+
+          InvertedList<T> list_;
       };
 
       struct FlatData : public ClusterData {
-          FlatData(std::vector<vec_t> &&cent) : ClusterData(std::move(cent)) {
+          FlatData(std::vector<vec_t> &&cent) : ClusterData(std::move(cent)), data_(ClusterData::centroid().size()) {
           }
 
           size_t data_num() const override {
@@ -130,7 +186,17 @@ namespace alp::ivf {
           }
 
           void add(const vec_t *vec_ptr, idx_t id, size_t dim) override {
-              data_.add(vec_ptr, id, dim);
+              data_.add(vec_ptr, id);
+          }
+
+          const idx_t *ids() const override {
+              return data_.list_.ids();
+          }
+
+          bool reconstruct(size_t row, vec_t *vec_ptr, size_t dim) const override {
+              const vec_t *code = data_.list_.code(row);
+              std::copy(code, code + dim, vec_ptr);
+              return true;
           }
 
           predict_type predict(int k, const vec_t *vec_ptr, size_t dim,
@@ -138,11 +204,16 @@ namespace alp::ivf {
               return data_.predict(k, vec_ptr, dim, type);
           }
 
+          void predict_batch(int k, const vec_t *const *queries, size_t nq, size_t dim, DistanceType type,
+                             predict_type *const *queues) override {
+              data_.predict_batch(queries, nq, dim, type, queues);
+          }
+
           void reserve(size_t size) override {
               data_.reserve(size);
           }
 
-          void clear() override {
+          void clear() {
               data_.clear();
           }
 
@@ -152,21 +223,23 @@ namespace alp::ivf {
       template<typename T>
       struct SQData : public ClusterData {
           size_t data_num() const override {
-              return sq_data_.data_num();
+              return sq_data_.data_num() + ids_.size();
           }
 
-          SQData(std::vector<T> &&cent) : ClusterData(std::move(cent)), quantizer_(ClusterData::centroid()) {
+          SQData(std::vector<vec_t> &&cent)
+                  : ClusterData(std::move(cent)), quantizer_(ClusterData::centroid()),
+                    sq_data_(ClusterData::centroid().size()) {
           }
 
           ClusterType type() const override {
-              if constexpr (std::is_same_v<T, int8_t>()) {
+              if constexpr (std::is_same_v<T, int8_t>) {
                   return kSQ_INT8;
-              } else if constexpr (std::is_same_v<T, float>()) {
+              } else if constexpr (std::is_same_v<T, float>) {
                   return kSQ_FP32;
-              } else if constexpr (std::is_same_v<T, std::float16_t>()) {
+              } else if constexpr (std::is_same_v<T, std::float16_t>) {
                   return kSQ_FP16;
                   #if defined(__GNUC__) && (__GNUC__ > 13) && defined(__STDCPP_BFLOAT16_T__)
-                  } else if constexpr (std::is_same_v<T, std::bfloat16_t>()) {
+                  } else if constexpr (std::is_same_v<T, std::bfloat16_t>) {
                       return kSQ_BF16;
                   #endif
               }
@@ -174,63 +247,99 @@ namespace alp::ivf {
           }
 
 
+          // vectors are staged in the quantizer until train, later ones are encoded with the trained range
           void add(const vec_t *vec_ptr, idx_t id, size_t dim) override {
-              data_.add(vec_ptr, id, dim);
-              quantizer_.add(vec_ptr, dim);
+              if (trained_) {
+                  quantizer_.encode(vec_ptr, sq_data_.list_.append(id));
+                  return;
+              }
+              ids_.push_back(id);
+              quantizer_.add_cluster(vec_ptr, dim);
           }
 
-          void reserve(size_t size) {
-              data_.reserve(size);
+          const idx_t *ids() const override {
+              return sq_data_.list_.ids();
+          }
+
+          void reserve(size_t size) override {
+              ids_.reserve(size);
               sq_data_.reserve(size);
           }
 
-          void train() {
+          void train() override {
               sq_data_.clear();
-              auto sq_d = quantizer_.train_clusters();
-              for (size_t i = 0; i < sq_d.size(); ++i) {
-                  sq_data_.add(std::move(sq_d), data_[i].id);
+              quantizer_.train();
+              auto dim = ClusterData::centroid().size();
+              sq_data_.reserve(ids_.size());
+              for (size_t i = 0; i < ids_.size(); ++i) {
+                  quantizer_.quantize_cluster(quantizer_.cluster(i), dim, sq_data_.list_.append(ids_[i]));
               }
-              data_.clear();
+              ids_.clear();
+              ids_.shrink_to_fit();
+              quantizer_.clear();
+              trained_ = true;
           }
 
           predict_type predict(int k, const vec_t *vec_ptr, size_t dim, DistanceType type) override {
-              bounded_priority_queue<predict_result, std::greater<>> queue(k);
-              for (const auto &data: sq_data_.datas_) {
+              predict_type queue(k);
+
+              typename IVF_ScalarQuantizer<T, vec_t>::QueryTerms terms;
+              quantizer_.prepare_query(vec_ptr, terms);
+
+              const auto &list = sq_data_.list_;
+              for (size_t i = 0; i < list.size(); ++i) {
+                  const T *code = list.code(i);
                   float dis = 0;
                   switch (type) {
                       case L2:
-                          dis = quantizer_.compute_distance_l2(vec_ptr, data.data.data());
+                          dis = quantizer_.compute_distance_l2(terms, code);
                           break;
                       case IP:
-                          dis = quantizer_.compute_distance_ip(vec_ptr, quantizer_.dequantize_cluster(data.data.data(),
-                                                                                                      data.data.size()));
-                          break;
                       case COSINE:
-                          dis = quantizer_.compute_distance_cosine(vec_ptr,
-                                                                   quantizer_.dequantize_cluster(data.data.data(),
-                                                                                                 data.data.size()));
+                          dis = quantizer_.compute_distance_ip(vec_ptr, terms, code);
                           break;
-
                       case UNKNOWN:
                           assert(false);
                           break;
                   }
-                  queue.push({data.id, dis});
+                  queue.push({list.id(i), ordered_distance(type, dis)});
               }
               return queue;
           }
 
+          void predict_batch(int k, const vec_t *const *queries, size_t nq, size_t dim, DistanceType type,
+                             predict_type *const *queues) override {
+              std::vector<typename IVF_ScalarQuantizer<T, vec_t>::QueryTerms> terms(nq);
+              for (size_t q = 0; q < nq; ++q) {
+                  quantizer_.prepare_query(queries[q], terms[q]);
+              }
+
+              const auto &list = sq_data_.list_;
+              size_t block = std::max<size_t>(ClusterDataT<T>::kMinBlockRows,
+                                              ClusterDataT<T>::kBlockBytes / (dim * sizeof(T)));
+              for (size_t i = 0; i < list.size(); i += block) {
+                  auto end = std::min(list.size(), i + block);
+                  for (size_t q = 0; q < nq; ++q) {
+                      for (size_t j = i; j < end; ++j) {
+                          const T *code = list.code(j);
+                          float dis = type == L2 ? quantizer_.compute_distance_l2(terms[q], code)
+                                                 : quantizer_.compute_distance_ip(queries[q], terms[q], code);
+                          queues[q]->push({list.id(j), ordered_distance(type, dis)});
+                      }
+                  }
+              }
+          }
+
+          bool trained_ = false;
           IVF_ScalarQuantizer<T, vec_t> quantizer_;
-          ClusterDataT<vec_t> data_;
+          // ids of the vectors staged in the quantizer
+          std::vector<idx_t> ids_;
           ClusterDataT<T> sq_data_;
       };
 
-      std::unique_ptr<ClusterData> add_cluster(std::vector<vec_t> &&centroid, ClusterType type) {
+      std::unique_ptr<ClusterData> &add_cluster(std::vector<vec_t> &&centroid, ClusterType type) {
           std::unique_ptr<ClusterData> ptr;
           switch (type) {
-              case kFlat:
-                  ptr = std::make_unique<FlatData>(std::move(centroid));
-                  break;
               case kSQ_INT8:
                   ptr = std::make_unique<SQData<int8_t>>(std::move(centroid));
                   break;
@@ -240,13 +349,22 @@ namespace alp::ivf {
               case kSQ_FP32:
                   ptr = std::make_unique<SQData<float>>(std::move(centroid));
                   break;
+#if defined(__STDCPP_BFLOAT16_T__)
+              case kSQ_BF16:
+                  ptr = std::make_unique<SQData<std::bfloat16_t>>(std::move(centroid));
+                  break;
+#endif
               case kPQ:
                   ptr = std::make_unique<PQData>(std::move(centroid));
                   break;
+              case kPQ4:
+                  ptr = std::make_unique<PQ4Data>(std::move(centroid));
+                  break;
 
+              case kFlat:
               default:
-                  assert(false);
-                  ptr = std::make_unique<ClusterDataT<vec_t>>();
+                  assert(type == kFlat);
+                  ptr = std::make_unique<FlatData>(std::move(centroid));
                   break;
           }
 
@@ -256,10 +374,12 @@ namespace alp::ivf {
 
       struct PQData : public ClusterData {
           size_t data_num() const override {
-              return datas_.size();
+              return pq_data_.data_num() + ids_.size();
           }
 
-          PQData(std::vector<vec_t> &&cent) : ClusterData(std::move(cent)) {
+          PQData(std::vector<vec_t> &&cent)
+                  : ClusterData(std::move(cent)), quantizer_(ClusterData::centroid()),
+                    pq_data_(quantizer_.code_size()) {
           }
 
           ClusterType type() const override {
@@ -267,53 +387,178 @@ namespace alp::ivf {
           }
 
           void add(const vec_t *vec_ptr, idx_t id, size_t dim) override {
-              data_.add(vec_ptr, id, dim);
-              quantizer_.add(vec_ptr, dim);
+              if (trained_) {
+                  quantizer_.encode(vec_ptr, pq_data_.list_.append(id));
+                  return;
+              }
+              ids_.push_back(id);
+              quantizer_.add_cluster(vec_ptr, dim);
           }
 
-          void reserve(size_t size) {
-              data_.reserve(size);
+          const idx_t *ids() const override {
+              return pq_data_.list_.ids();
+          }
+
+          void reserve(size_t size) override {
+              ids_.reserve(size);
               pq_data_.reserve(size);
           }
 
-          void train() {
+          void train() override {
               pq_data_.clear();
-              auto sq_d = quantizer_.train_clusters();
-              for (size_t i = 0; i < sq_d.size(); ++i) {
-                  pq_data_.add(std::move(sq_d), data_[i].id);
+              quantizer_.train();
+              pq_data_.reserve(ids_.size());
+              for (size_t i = 0; i < ids_.size(); ++i) {
+                  quantizer_.quantize_cluster(quantizer_.cluster(i), pq_data_.list_.append(ids_[i]));
               }
-              data_.clear();
+              ids_.clear();
+              ids_.shrink_to_fit();
+              quantizer_.clear();
+              trained_ = true;
           }
 
+          // one lookup table per query and cluster, each code is then m table lookups
           predict_type predict(int k, const vec_t *vec_ptr, size_t dim, DistanceType type) override {
-              bounded_priority_queue<predict_result, std::greater<>> queue(k);
-              for (const auto &data: pq_data_.datas_) {
-                  float dis = 0;
-                  switch (type) {
-                      case L2:
-                          dis = quantizer_.compute_distance_l2(vec_ptr, data.data.data());
-                          break;
-                      case IP:
-                          dis = quantizer_.compute_distance_ip(vec_ptr, data.data.data());
-                          break;
-                      case COSINE:
-                          dis = quantizer_.compute_distance_cosine(vec_ptr,
-                                                                   data.data.data());
-                          break;
-                      case UNKNOWN:
-                          assert(false);
-                          break;
-                  }
-                  queue.push({data.id, dis});
+              predict_type queue(k);
+              if (pq_data_.data_num() == 0) {
+                  return queue;
+              }
+
+              typename IVF_ProductQuantizer<vec_t>::QueryTable table;
+              quantizer_.prepare_query(type, vec_ptr, table);
+
+              const auto &list = pq_data_.list_;
+              for (size_t i = 0; i < list.size(); ++i) {
+                  float dis = quantizer_.compute_distance(table, list.code(i));
+                  queue.push({list.id(i), ordered_distance(type, dis)});
               }
               return queue;
           }
 
+          bool trained_ = false;
           IVF_ProductQuantizer<vec_t> quantizer_;
-          ClusterDataT<vec_t> data_;
+          // ids of the vectors staged in the quantizer
+          std::vector<idx_t> ids_;
           ClusterDataT<uint8_t> pq_data_;
       };
 
+      // Fast scan variant of PQData: 4-bit codes packed in blocks of 32 are scored against uint8 tables held in
+      // registers, then the best kRerank * k candidates are rescored exactly on the vectors the list keeps next to
+      // its codes.
+      struct PQ4Data : public ClusterData {
+          static constexpr int kRerank = 4;
+
+          size_t data_num() const override {
+              return list_.size() + ids_.size();
+          }
+
+          PQ4Data(std::vector<vec_t> &&cent)
+                  : ClusterData(std::move(cent)), quantizer_(ClusterData::centroid(), 8, 4),
+                    list_(quantizer_.code_size()), scan_calc_(pq4_scan_kernel()), code_(quantizer_.code_size()),
+                    residual_(ClusterData::centroid().size()) {
+          }
+
+          ClusterType type() const override {
+              return kPQ4;
+          }
+
+          void add(const vec_t *vec_ptr, idx_t id, size_t dim) override {
+              vectors_.insert(vectors_.end(), vec_ptr, vec_ptr + dim);
+              if (trained_) {
+                  const auto &centroid = ClusterData::centroid();
+                  for (size_t i = 0; i < dim; ++i) {
+                      residual_[i] = vec_ptr[i] - centroid[i];
+                  }
+                  quantizer_.quantize_cluster(residual_.data(), code_.data());
+                  list_.add(code_.data(), id);
+                  return;
+              }
+              ids_.push_back(id);
+              quantizer_.add_cluster(vec_ptr, dim);
+          }
+
+          const idx_t *ids() const override {
+              return list_.ids();
+          }
+
+          bool reconstruct(size_t row, vec_t *vec_ptr, size_t dim) const override {
+              std::copy_n(vectors_.data() + row * dim, dim, vec_ptr);
+              return true;
+          }
+
+          void reserve(size_t size) override {
+              ids_.reserve(size);
+              list_.reserve(size);
+              vectors_.reserve(size * ClusterData::centroid().size());
+          }
+
+          void train() override {
+              list_.clear();
+              quantizer_.train();
+              list_.reserve(ids_.size());
+              for (size_t i = 0; i < ids_.size(); ++i) {
+                  quantizer_.quantize_cluster(quantizer_.cluster(i), code_.data());
+                  list_.add(code_.data(), ids_[i]);
+              }
+              ids_.clear();
+              ids_.shrink_to_fit();
+              quantizer_.clear();
+              trained_ = true;
+          }
+
+          predict_type predict(int k, const vec_t *vec_ptr, size_t dim, DistanceType type) override {
+              predict_type queue(k);
+              if (list_.empty()) {
+                  return queue;
+              }
+
+              // the tables are flipped for similarities so that every sum is smaller is closer
+              typename IVF_ProductQuantizer<vec_t>::QueryTable table;
+              quantizer_.prepare_query(type, vec_ptr, table);
+              if (type != L2) {
+                  for (auto &t: table.table) {
+                      t = -t;
+                  }
+                  table.bias = -table.bias;
+              }
+              PQ4Table lut;
+              quantizer_.prepare_fast_scan(table, lut);
+
+              predict_type candidates(static_cast<size_t>(k) * kRerank);
+              uint16_t sums[PackedInvertedList::kBlockRows];
+              int pairs = static_cast<int>(list_.pairs());
+              for (size_t b = 0; b < list_.block_num(); ++b) {
+                  scan_calc_(lut.lut.data(), list_.block(b), pairs, sums);
+                  size_t begin = b * PackedInvertedList::kBlockRows;
+                  size_t n = std::min(PackedInvertedList::kBlockRows, list_.size() - begin);
+                  for (size_t j = 0; j < n; ++j) {
+                      candidates.push({static_cast<idx_t>(begin + j), sums[j] / lut.scale + lut.bias});
+                  }
+              }
+
+              DistanceCalc<vec_t> calc(type, dim);
+              while (!candidates.empty()) {
+                  auto row = static_cast<size_t>(candidates.top().id);
+                  candidates.pop();
+                  float dis = calc(vec_ptr, vectors_.data() + row * dim, dim);
+                  queue.push({list_.id(row), ordered_distance(type, dis)});
+              }
+              return queue;
+          }
+
+          bool trained_ = false;
+          IVF_ProductQuantizer<vec_t> quantizer_;
+          // ids of the vectors staged in the quantizer
+          std::vector<idx_t> ids_;
+          PackedInvertedList list_;
+          pq4_scan_func scan_calc_;
+          // scratch of add and train, a code is packed into list_ from here
+          std::vector<uint8_t> code_;
+          std::vector<vec_t> residual_;
+          // the vectors of the rows in list order, for the rescoring
+          std::vector<vec_t> vectors_;
+      };
+
       size_t size() const {
           return datas_.size();
       }
@@ -326,6 +571,10 @@ namespace alp::ivf {
           return datas_[i];
       }
 
+      const std::unique_ptr<ClusterData> &operator[](int i) const {
+          return datas_[i];
+      }
+
       void reserve(size_t size) {
           datas_.reserve(size);
       }
@@ -336,33 +585,108 @@ namespace alp::ivf {
   template<typename vec_t = float>
   class IvfIndex : public alp::VectorIndex<vec_t> {
   public:
-      IvfIndex(ClusterType c_type, int lists, int probes, int dim, DistanceType type);
+      // build runs on threads - 1 background threads plus the calling one
+      IvfIndex(ClusterType c_type, int lists, int probes, int dim, DistanceType type, int threads = 1);
 
       ~IvfIndex() noexcept = default;
 
+      // ids are not checked for duplicates
       Status add(idx_t id, const vec_t *vec_ptr) override;
 
+      // the id is the insertion order
+      Status add(const vec_t *vec_ptr) override;
+
       Status build() override;
 
       Status search(const vec_t *query_vec, size_t k,
                     std::vector<idx_t> &result_ids,
                     std::vector<float> &result_distances) const override;
 
+      // probes of all queries come from one pass over the centroids, then every probed list is scanned once
+      // against all the queries probing it
+      Status search_batch(size_t n, const vec_t *queries, size_t k,
+                          std::vector<idx_t> &result_ids,
+                          std::vector<float> &result_distances) const override;
+
       size_t dimension() const override;
 
       size_t size() const override;
 
+      // the vector as it was added, cosine indexes store it normalised and scale it back by its norm. The id is
+      // found by scanning the id arrays, after build only flat and PQ4 lists keep the vectors and the other
+      // types return NotSupported.
+      Status reconstruct(idx_t id, vec_t *vec_ptr) const;
+
+      // shares an executor with the caller instead of the one owned by the index, nullptr builds inline
+      void set_executor(Executor *executor);
+
+      // scans the probed lists of a single query on the executor workers, off by default
+      void set_parallel_probe(bool enable);
+
+      // picks probes and build assignments with an hnsw graph over the centroids instead of scanning all of
+      // them, call before build. The graph only ranks by L2, IP and cosine indexes get InvalidArgument since
+      // their centroids are scanned by inner product.
+      Status use_hnsw_quantizer(int M = 32, int ef_construction = 200, int ef_search = 64);
+
+      // candidate list size of the centroid graph search, at least the number of probes is used
+      void set_quantizer_ef(int ef);
+
+      // coarse k-means trains on at most points_per_list * lists random vectors, 256 by default and 0 for all
+      void set_training_sample(size_t points_per_list);
+
+      // trains the coarse centroids with mini-batches of batch_size vectors instead of full Lloyd iterations,
+      // ignored when the lists are balanced
+      void set_mini_batch(size_t batch_size);
+
+      // bounds the inverted lists to about max_ratio times the mean size by training balanced coarse centroids
+      // with full Lloyd iterations, even if a mini-batch is set, 0 for plain k-means, call before build. Other
+      // ratios must be above 1, InvalidArgument otherwise.
+      Status set_balanced_lists(double max_ratio);
+
 
   private:
+      // nprobe closest centroids of each of the n rows of x, best first, missing ones get label -1
+      void assign(const vec_t *x, size_t n, size_t nprobe, idx_t *labels, float *dis) const;
+
+      // writes the queue best first
+      static void dump_results(typename IvfCluster<vec_t>::predict_type &queue, DistanceType type, idx_t *ids,
+                               float *distances);
+
+      // smallest number of rows a build worker assigns at once
+      static constexpr size_t kAssignGrain = 1024;
+
+      static constexpr size_t kTrainPointsPerList = 256;
+
       bool is_inited_ = false;
       IvfIndexFileHeader header_;
 
       IvfCluster<vec_t> ivf_clusters_;
 
-      std::unordered_map<idx_t, data_type<vec_t>> datas_;
+      // vectors added before build back to back with their ids and, for a cosine index, their original norms in
+      // parallel arrays, released once build has moved them into the lists
+      std::vector<vec_t> vectors_;
+      std::vector<idx_t> ids_;
+      std::vector<float> norms_;
+      // original norms of the vectors of a cosine index in the row order of every list
+      std::vector<std::vector<float>> list_norms_;
+      size_t vector_num_ = 0;
       DistanceCalc<vec_t> calc_;
 
+      // centroids stored back to back, the base of the coarse quantizer
+      std::vector<vec_t> centroids_;
+      PairwiseDistance<vec_t> coarse_;
+
+      // optional graph over the centroids replacing the scan of coarse_, hnsw_M_ = 0 leaves it off
+      std::unique_ptr<hnsw::hnsw<vec_t>> coarse_hnsw_;
+      int hnsw_M_ = 0;
+      int hnsw_ef_construction_ = 200;
+      int hnsw_ef_search_ = 64;
+
       KMeansPP<vec_t> kmeans_;
+
+      std::unique_ptr<Executor> owned_executor_;
+      Executor *executor_ = nullptr;
+      bool parallel_probe_ = false;
   };
 
-}
\ No newline at end of file
+}
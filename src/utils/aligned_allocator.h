@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+
+namespace alp {
+
+  // std allocator handing out Align byte aligned storage, 64 keeps rows on cache line boundaries
+  template<typename T, size_t Align = 64>
+  struct AlignedAllocator {
+      using value_type = T;
+
+      template<typename U>
+      struct rebind {
+          using other = AlignedAllocator<U, Align>;
+      };
+
+      AlignedAllocator() noexcept = default;
+
+      template<typename U>
+      AlignedAllocator(const AlignedAllocator<U, Align> &) noexcept {}
+
+      T *allocate(size_t n) {
+          return static_cast<T *>(::operator new(n * sizeof(T), std::align_val_t(Align)));
+      }
+
+      void deallocate(T *p, size_t) noexcept {
+          ::operator delete(p, std::align_val_t(Align));
+      }
+
+      template<typename U>
+      bool operator==(const AlignedAllocator<U, Align> &) const noexcept {
+          return true;
+      }
+  };
+
+}
@@ -10,7 +10,9 @@ namespace alp {
       using priority_queue_type = std::priority_queue<T, std::vector<T>, Compare>;
 
       explicit bounded_priority_queue(size_t max_size) : max_size_(max_size) {
-          queue_.reserve(max_size);
+          std::vector<T> container;
+          container.reserve(max_size);
+          queue_ = priority_queue_type(Compare(), std::move(container));
       }
 
       bounded_priority_queue() = delete;
@@ -1,6 +1,10 @@
 #pragma once
 
 #include <cmath>
+#include <type_traits>
+#include <vector>
+
+#include "utils/distance_simd.h"
 
 namespace alp {
   enum DistanceType {
@@ -14,43 +18,17 @@ namespace alp {
   static constexpr inline float l2_distance(const vec_t *a, const vec_t *b, int size) {
       float sum = 0;
       for (int i = 0; i < size; i++) {
-          float diff = a[i] - b[i];
+          float diff = static_cast<float>(a[i]) - static_cast<float>(b[i]);
           sum += diff * diff;
       }
       return sum;
-
-//          __m256 sum_vec = _mm256_setzero_ps();
-//          int i;
-//
-//          // 处理 8 个 float 数据
-//          for (i = 0; i <= size - 8; i += 8) {
-//              __m256 a_vec = _mm256_loadu_ps(&a[i]);
-//              __m256 b_vec = _mm256_loadu_ps(&b[i]);
-//              __m256 diff_vec = _mm256_sub_ps(a_vec, b_vec);
-//              sum_vec = _mm256_add_ps(sum_vec, _mm256_mul_ps(diff_vec, diff_vec));
-//          }
-//
-//          float sum[8];
-//          _mm256_storeu_ps(sum, sum_vec);
-//
-//          float total_sum = 0.0f;
-//          for (int j = 0; j < 8; j++) {
-//              total_sum += sum[j];
-//          }
-//
-//          for (; i < size; i++) {
-//              float diff = a[i] - b[i];
-//              total_sum += diff * diff;
-//          }
-//
-//          return total_sum;
   }
 
   template<typename vec_t>
   static constexpr inline float ip_distance(const vec_t *a, const vec_t *b, int size) {
       float sum = 0;
       for (int i = 0; i < size; i++) {
-          sum += a[i] * b[i];
+          sum += static_cast<float>(a[i]) * static_cast<float>(b[i]);
       }
       return sum;
   }
@@ -69,6 +47,16 @@ namespace alp {
       return dot_product / (std::sqrt(norm_a) * std::sqrt(norm_b));
   }
 
+  template<typename vec_t, auto kernel, typename Rows>
+  static inline void distance_batch(const vec_t *query, Rows rows, size_t n, int size, const uint8_t *mask,
+                                    float *out) {
+      for (size_t i = 0; i < n; ++i) {
+          if (mask == nullptr || bitmap_test(mask, i)) {
+              out[i] = kernel(query, rows(i), size);
+          }
+      }
+  }
+
   static inline constexpr float EPSILON = 1e-6f;
 
   template<typename vec_t>
@@ -76,42 +64,43 @@ namespace alp {
   public:
       DistanceCalc() = default;
 
-      explicit DistanceCalc(DistanceType type) {
-          switch (type) {
-              case DistanceType::L2:
-                  calc = l2_distance<vec_t>;
-                  break;
-              case DistanceType::IP:
-                  calc = ip_distance<vec_t>;
-                  break;
-              case DistanceType::COSINE:
-                  calc = cosine_distance<vec_t>;
-                  break;
-              default:
-                  calc = l2_distance<vec_t>;
-                  break;
-          }
+      // passing the vector dimension lets common dimensions bind kernels specialised for it, such a calculator
+      // must then only be called with that size
+      explicit DistanceCalc(DistanceType type, int dim = 0) {
+          init(type, dim);
       }
 
-      void init(DistanceType type) {
+      void init(DistanceType type, int dim = 0) {
           switch (type) {
-              case DistanceType::L2:
-                  calc = l2_distance<vec_t>;
-                  break;
               case DistanceType::IP:
-                  calc = ip_distance<vec_t>;
+                  bind<ip_distance<vec_t>>();
                   break;
               case DistanceType::COSINE:
-                  calc = cosine_distance<vec_t>;
+                  bind<cosine_distance<vec_t>>();
                   break;
               default:
-                  calc = l2_distance<vec_t>;
+                  bind<l2_distance<vec_t>>();
                   break;
           }
+
+          if constexpr (std::is_same_v<vec_t, float>) {
+              init_simd(type, dim);
+          }
       }
 
       float operator()(const vec_t *a, const vec_t *b, int size) const { return calc(a, b, size); }
 
+      // distances from query to n vectors stored back to back, rows whose bit is clear in mask are skipped
+      void batch(const vec_t *query, const vec_t *base, size_t n, int size, float *out,
+                 const uint8_t *mask = nullptr) const {
+          batch_calc(query, BlockRows<vec_t>{base, static_cast<size_t>(size)}, n, size, mask, out);
+      }
+
+      void batch(const vec_t *query, const vec_t *const *vecs, size_t n, int size, float *out,
+                 const uint8_t *mask = nullptr) const {
+          gather_calc(query, GatherRows<vec_t>{vecs}, n, size, mask, out);
+      }
+
       static int compare(const vec_t &a, const vec_t &b) {
           float cmp = a - b;
           if (cmp > EPSILON) {
@@ -134,7 +123,149 @@ namespace alp {
       }
 
   private:
+      template<auto kernel>
+      void bind() {
+          calc = kernel;
+          batch_calc = distance_batch<vec_t, kernel, BlockRows<vec_t>>;
+          gather_calc = distance_batch<vec_t, kernel, GatherRows<vec_t>>;
+      }
+
+      void init_simd(DistanceType type, int dim) {
+#if defined(ALP_SIMD_X86)
+          if (init_fixed_dim(type, dim)) {
+              return;
+          }
+
+          switch (simd_level()) {
+              case kAVX512:
+                  switch (type) {
+                      case DistanceType::IP:
+                          bind_avx512<ip_distance_avx512, ip_distance_x4_avx512>();
+                          break;
+                      case DistanceType::COSINE:
+                          bind_avx512<cosine_distance_avx512, cosine_distance_x4_avx512>();
+                          break;
+                      default:
+                          bind_avx512<l2_distance_avx512, l2_distance_x4_avx512>();
+                          break;
+                  }
+                  break;
+              case kAVX2:
+                  switch (type) {
+                      case DistanceType::IP:
+                          bind_avx2<ip_distance_avx2, ip_distance_x4_avx2>();
+                          break;
+                      case DistanceType::COSINE:
+                          bind_avx2<cosine_distance_avx2, cosine_distance_x4_avx2>();
+                          break;
+                      default:
+                          bind_avx2<l2_distance_avx2, l2_distance_x4_avx2>();
+                          break;
+                  }
+                  break;
+              case kScalar:
+                  break;
+          }
+#endif
+      }
+
+#if defined(ALP_SIMD_X86)
+      bool init_fixed_dim(DistanceType type, int dim) {
+          switch (dim) {
+              case 96:
+                  return bind_fixed_dim<96>(type);
+              case 128:
+                  return bind_fixed_dim<128>(type);
+              case 384:
+                  return bind_fixed_dim<384>(type);
+              case 768:
+                  return bind_fixed_dim<768>(type);
+              case 1024:
+                  return bind_fixed_dim<1024>(type);
+              default:
+                  return false;
+          }
+      }
+
+      template<int D>
+      bool bind_fixed_dim(DistanceType type) {
+          if (type != DistanceType::L2 && type != DistanceType::IP) {
+              return false;
+          }
+
+          switch (simd_level()) {
+              case kAVX512:
+                  if (type == DistanceType::IP) {
+                      bind_avx512<ip_distance_avx512_dim<D>, ip_distance_x4_avx512_dim<D>>();
+                  } else {
+                      bind_avx512<l2_distance_avx512_dim<D>, l2_distance_x4_avx512_dim<D>>();
+                  }
+                  return true;
+              case kAVX2:
+                  if (type == DistanceType::IP) {
+                      bind_avx2<ip_distance_avx2_dim<D>, ip_distance_x4_avx2_dim<D>>();
+                  } else {
+                      bind_avx2<l2_distance_avx2_dim<D>, l2_distance_x4_avx2_dim<D>>();
+                  }
+                  return true;
+              case kScalar:
+                  break;
+          }
+          return false;
+      }
+
+      template<auto kernel, auto kernel_x4>
+      void bind_avx2() {
+          calc = kernel;
+          batch_calc = distance_batch_avx2<kernel, kernel_x4, BlockRows<float>>;
+          gather_calc = distance_batch_avx2<kernel, kernel_x4, GatherRows<float>>;
+      }
+
+      template<auto kernel, auto kernel_x4>
+      void bind_avx512() {
+          calc = kernel;
+          batch_calc = distance_batch_avx512<kernel, kernel_x4, BlockRows<float>>;
+          gather_calc = distance_batch_avx512<kernel, kernel_x4, GatherRows<float>>;
+      }
+#endif
+
       float (*calc)(const vec_t *a, const vec_t *b, int size) = nullptr;
+
+      void (*batch_calc)(const vec_t *query, BlockRows<vec_t> rows, size_t n, int size, const uint8_t *mask,
+                         float *out) = nullptr;
+
+      void (*gather_calc)(const vec_t *query, GatherRows<vec_t> rows, size_t n, int size, const uint8_t *mask,
+                          float *out) = nullptr;
   };
-}
 
+  // cosine indexes keep unit length vectors, on which cosine similarity is just the inner product
+  static constexpr inline DistanceType scan_distance_type(DistanceType type) {
+      return type == COSINE ? IP : type;
+  }
+
+  // scales vec to unit length in place and returns its original norm
+  template<typename vec_t>
+  static inline float normalize(vec_t *vec, int size) {
+      static const DistanceCalc<vec_t> calc(IP);
+      float norm = std::sqrt(calc(vec, vec, size));
+      if (norm > 0) {
+          float inv = 1.0f / norm;
+          for (int i = 0; i < size; i++) {
+              vec[i] *= inv;
+          }
+      }
+      return norm;
+  }
+
+  // the query itself, or a unit length copy of it kept in buffer for cosine
+  template<typename vec_t>
+  static inline const vec_t *prepare_query(DistanceType type, const vec_t *query, int size,
+                                           std::vector<vec_t> &buffer) {
+      if (type != COSINE) {
+          return query;
+      }
+      buffer.assign(query, query + size);
+      normalize(buffer.data(), size);
+      return buffer.data();
+  }
+}
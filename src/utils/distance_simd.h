@@ -0,0 +1,918 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ALP_SIMD_X86 1
+#define ALP_TARGET_AVX2 __attribute__((target("avx2,fma,f16c")))
+#define ALP_TARGET_AVX512 __attribute__((target("avx512f,avx512bw,avx512vl")))
+#define ALP_TARGET_AVX512_VNNI __attribute__((target("avx512f,avx512bw,avx512vl,avx512vnni")))
+#endif
+
+namespace alp {
+
+  enum SimdLevel {
+      kScalar = 0,
+      kAVX2 = 1,
+      kAVX512 = 2,
+  };
+
+  static inline SimdLevel detect_simd_level() {
+#if defined(ALP_SIMD_X86)
+      __builtin_cpu_init();
+      if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+          __builtin_cpu_supports("avx512vl")) {
+          return kAVX512;
+      }
+      if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("f16c")) {
+          return kAVX2;
+      }
+#endif
+      return kScalar;
+  }
+
+  // cpuid is only queried once per process
+  static inline SimdLevel simd_level() {
+      static const SimdLevel level = detect_simd_level();
+      return level;
+  }
+
+  static inline bool simd_has_vnni() {
+#if defined(ALP_SIMD_X86)
+      static const bool vnni = simd_level() == kAVX512 && __builtin_cpu_supports("avx512vnni");
+      return vnni;
+#else
+      return false;
+#endif
+  }
+
+  static inline bool bitmap_test(const uint8_t *mask, size_t i) {
+      return (mask[i >> 3] >> (i & 7)) & 1;
+  }
+
+  static inline bool bitmap_test4(const uint8_t *mask, size_t i) {
+      return bitmap_test(mask, i) && bitmap_test(mask, i + 1) && bitmap_test(mask, i + 2) && bitmap_test(mask, i + 3);
+  }
+
+  // Product quantizer lookup tables hold kPQTableStride entries per sub quantizer, the entry of a code is
+  // table[i * kPQTableStride + code[i]]
+  static constexpr int kPQTableStride = 256;
+
+  template<typename vec_t>
+  struct BlockRows {
+      const vec_t *operator()(size_t i) const {
+          return base + i * size;
+      }
+
+      const vec_t *base;
+      size_t size;
+  };
+
+  template<typename vec_t>
+  struct GatherRows {
+      const vec_t *operator()(size_t i) const {
+          return vecs[i];
+      }
+
+      const vec_t *const *vecs;
+  };
+
+#if defined(ALP_SIMD_X86)
+
+  ALP_TARGET_AVX2 static inline float reduce_add_avx2(__m256 v) {
+      __m128 lo = _mm256_castps256_ps128(v);
+      __m128 hi = _mm256_extractf128_ps(v, 1);
+      lo = _mm_add_ps(lo, hi);
+      lo = _mm_add_ps(lo, _mm_movehl_ps(lo, lo));
+      lo = _mm_add_ss(lo, _mm_movehdup_ps(lo));
+      return _mm_cvtss_f32(lo);
+  }
+
+  ALP_TARGET_AVX2 static inline float l2_distance_avx2(const float *a, const float *b, int size) {
+      __m256 sum0 = _mm256_setzero_ps();
+      __m256 sum1 = _mm256_setzero_ps();
+      int i = 0;
+
+      for (; i + 16 <= size; i += 16) {
+          __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+          __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+          sum0 = _mm256_fmadd_ps(d0, d0, sum0);
+          sum1 = _mm256_fmadd_ps(d1, d1, sum1);
+      }
+      if (i + 8 <= size) {
+          __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+          sum0 = _mm256_fmadd_ps(d0, d0, sum0);
+          i += 8;
+      }
+
+      float sum = reduce_add_avx2(_mm256_add_ps(sum0, sum1));
+      for (; i < size; i++) {
+          float diff = a[i] - b[i];
+          sum += diff * diff;
+      }
+      return sum;
+  }
+
+  ALP_TARGET_AVX2 static inline float ip_distance_avx2(const float *a, const float *b, int size) {
+      __m256 sum0 = _mm256_setzero_ps();
+      __m256 sum1 = _mm256_setzero_ps();
+      int i = 0;
+
+      for (; i + 16 <= size; i += 16) {
+          sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), sum0);
+          sum1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), sum1);
+      }
+      if (i + 8 <= size) {
+          sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), sum0);
+          i += 8;
+      }
+
+      float sum = reduce_add_avx2(_mm256_add_ps(sum0, sum1));
+      for (; i < size; i++) {
+          sum += a[i] * b[i];
+      }
+      return sum;
+  }
+
+  ALP_TARGET_AVX2 static inline float cosine_distance_avx2(const float *a, const float *b, int size) {
+      __m256 dot = _mm256_setzero_ps();
+      __m256 na = _mm256_setzero_ps();
+      __m256 nb = _mm256_setzero_ps();
+      int i = 0;
+
+      for (; i + 8 <= size; i += 8) {
+          __m256 va = _mm256_loadu_ps(a + i);
+          __m256 vb = _mm256_loadu_ps(b + i);
+          dot = _mm256_fmadd_ps(va, vb, dot);
+          na = _mm256_fmadd_ps(va, va, na);
+          nb = _mm256_fmadd_ps(vb, vb, nb);
+      }
+
+      float dot_product = reduce_add_avx2(dot);
+      float norm_a = reduce_add_avx2(na);
+      float norm_b = reduce_add_avx2(nb);
+      for (; i < size; i++) {
+          dot_product += a[i] * b[i];
+          norm_a += a[i] * a[i];
+          norm_b += b[i] * b[i];
+      }
+      return dot_product / (std::sqrt(norm_a) * std::sqrt(norm_b));
+  }
+
+  ALP_TARGET_AVX2 static inline void l2_distance_x4_avx2(const float *q, const float *y0, const float *y1,
+                                                         const float *y2, const float *y3, int size, float *out) {
+      __m256 s0 = _mm256_setzero_ps();
+      __m256 s1 = _mm256_setzero_ps();
+      __m256 s2 = _mm256_setzero_ps();
+      __m256 s3 = _mm256_setzero_ps();
+      int i = 0;
+
+      for (; i + 8 <= size; i += 8) {
+          __m256 vq = _mm256_loadu_ps(q + i);
+          __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(y0 + i), vq);
+          __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(y1 + i), vq);
+          __m256 d2 = _mm256_sub_ps(_mm256_loadu_ps(y2 + i), vq);
+          __m256 d3 = _mm256_sub_ps(_mm256_loadu_ps(y3 + i), vq);
+          s0 = _mm256_fmadd_ps(d0, d0, s0);
+          s1 = _mm256_fmadd_ps(d1, d1, s1);
+          s2 = _mm256_fmadd_ps(d2, d2, s2);
+          s3 = _mm256_fmadd_ps(d3, d3, s3);
+      }
+
+      out[0] = reduce_add_avx2(s0);
+      out[1] = reduce_add_avx2(s1);
+      out[2] = reduce_add_avx2(s2);
+      out[3] = reduce_add_avx2(s3);
+      for (; i < size; i++) {
+          float d0 = y0[i] - q[i];
+          float d1 = y1[i] - q[i];
+          float d2 = y2[i] - q[i];
+          float d3 = y3[i] - q[i];
+          out[0] += d0 * d0;
+          out[1] += d1 * d1;
+          out[2] += d2 * d2;
+          out[3] += d3 * d3;
+      }
+  }
+
+  ALP_TARGET_AVX2 static inline void ip_distance_x4_avx2(const float *q, const float *y0, const float *y1,
+                                                         const float *y2, const float *y3, int size, float *out) {
+      __m256 s0 = _mm256_setzero_ps();
+      __m256 s1 = _mm256_setzero_ps();
+      __m256 s2 = _mm256_setzero_ps();
+      __m256 s3 = _mm256_setzero_ps();
+      int i = 0;
+
+      for (; i + 8 <= size; i += 8) {
+          __m256 vq = _mm256_loadu_ps(q + i);
+          s0 = _mm256_fmadd_ps(_mm256_loadu_ps(y0 + i), vq, s0);
+          s1 = _mm256_fmadd_ps(_mm256_loadu_ps(y1 + i), vq, s1);
+          s2 = _mm256_fmadd_ps(_mm256_loadu_ps(y2 + i), vq, s2);
+          s3 = _mm256_fmadd_ps(_mm256_loadu_ps(y3 + i), vq, s3);
+      }
+
+      out[0] = reduce_add_avx2(s0);
+      out[1] = reduce_add_avx2(s1);
+      out[2] = reduce_add_avx2(s2);
+      out[3] = reduce_add_avx2(s3);
+      for (; i < size; i++) {
+          out[0] += y0[i] * q[i];
+          out[1] += y1[i] * q[i];
+          out[2] += y2[i] * q[i];
+          out[3] += y3[i] * q[i];
+      }
+  }
+
+  ALP_TARGET_AVX2 static inline void cosine_distance_x4_avx2(const float *q, const float *y0, const float *y1,
+                                                             const float *y2, const float *y3, int size, float *out) {
+      out[0] = cosine_distance_avx2(q, y0, size);
+      out[1] = cosine_distance_avx2(q, y1, size);
+      out[2] = cosine_distance_avx2(q, y2, size);
+      out[3] = cosine_distance_avx2(q, y3, size);
+  }
+
+  // Kernels for a dimension known at compile time: the trip count is fixed and there is no tail to handle.
+  // The size argument is ignored, it is only kept so they can be bound wherever the generic kernels are.
+  template<int D>
+  ALP_TARGET_AVX2 static inline float l2_distance_avx2_dim(const float *a, const float *b, int) {
+      static_assert(D % 16 == 0);
+      __m256 sum0 = _mm256_setzero_ps();
+      __m256 sum1 = _mm256_setzero_ps();
+
+#pragma GCC unroll 8
+      for (int i = 0; i < D; i += 16) {
+          __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+          __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+          sum0 = _mm256_fmadd_ps(d0, d0, sum0);
+          sum1 = _mm256_fmadd_ps(d1, d1, sum1);
+      }
+      return reduce_add_avx2(_mm256_add_ps(sum0, sum1));
+  }
+
+  template<int D>
+  ALP_TARGET_AVX2 static inline float ip_distance_avx2_dim(const float *a, const float *b, int) {
+      static_assert(D % 16 == 0);
+      __m256 sum0 = _mm256_setzero_ps();
+      __m256 sum1 = _mm256_setzero_ps();
+
+#pragma GCC unroll 8
+      for (int i = 0; i < D; i += 16) {
+          sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), sum0);
+          sum1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), sum1);
+      }
+      return reduce_add_avx2(_mm256_add_ps(sum0, sum1));
+  }
+
+  template<int D>
+  ALP_TARGET_AVX2 static inline void l2_distance_x4_avx2_dim(const float *q, const float *y0, const float *y1,
+                                                             const float *y2, const float *y3, int, float *out) {
+      l2_distance_x4_avx2(q, y0, y1, y2, y3, D, out);
+  }
+
+  template<int D>
+  ALP_TARGET_AVX2 static inline void ip_distance_x4_avx2_dim(const float *q, const float *y0, const float *y1,
+                                                             const float *y2, const float *y3, int, float *out) {
+      ip_distance_x4_avx2(q, y0, y1, y2, y3, D, out);
+  }
+
+  // one query against n rows, four rows per step so every query load is shared
+  template<auto kernel, auto kernel_x4, typename Rows>
+  ALP_TARGET_AVX2 static inline void distance_batch_avx2(const float *query, Rows rows, size_t n, int size,
+                                                         const uint8_t *mask, float *out) {
+      size_t i = 0;
+      for (; i + 4 <= n; i += 4) {
+          if (mask == nullptr || bitmap_test4(mask, i)) {
+              kernel_x4(query, rows(i), rows(i + 1), rows(i + 2), rows(i + 3), size, out + i);
+              continue;
+          }
+          for (size_t j = i; j < i + 4; ++j) {
+              if (bitmap_test(mask, j)) {
+                  out[j] = kernel(query, rows(j), size);
+              }
+          }
+      }
+      for (; i < n; ++i) {
+          if (mask == nullptr || bitmap_test(mask, i)) {
+              out[i] = kernel(query, rows(i), size);
+          }
+      }
+  }
+
+  // inner products of rows x0, x1 against four consecutive rows of y, stored at out[0..3] and out[ldo..ldo + 3]
+  ALP_TARGET_AVX2 static inline void inner_product_2x4_avx2(const float *x0, const float *x1, const float *y,
+                                                            int dim, float *out, size_t ldo) {
+      const float *y0 = y;
+      const float *y1 = y + dim;
+      const float *y2 = y + 2 * dim;
+      const float *y3 = y + 3 * dim;
+      __m256 s00 = _mm256_setzero_ps(), s01 = _mm256_setzero_ps(), s02 = _mm256_setzero_ps(), s03 = _mm256_setzero_ps();
+      __m256 s10 = _mm256_setzero_ps(), s11 = _mm256_setzero_ps(), s12 = _mm256_setzero_ps(), s13 = _mm256_setzero_ps();
+      int i = 0;
+
+      for (; i + 8 <= dim; i += 8) {
+          __m256 a0 = _mm256_loadu_ps(x0 + i);
+          __m256 a1 = _mm256_loadu_ps(x1 + i);
+          __m256 b = _mm256_loadu_ps(y0 + i);
+          s00 = _mm256_fmadd_ps(a0, b, s00);
+          s10 = _mm256_fmadd_ps(a1, b, s10);
+          b = _mm256_loadu_ps(y1 + i);
+          s01 = _mm256_fmadd_ps(a0, b, s01);
+          s11 = _mm256_fmadd_ps(a1, b, s11);
+          b = _mm256_loadu_ps(y2 + i);
+          s02 = _mm256_fmadd_ps(a0, b, s02);
+          s12 = _mm256_fmadd_ps(a1, b, s12);
+          b = _mm256_loadu_ps(y3 + i);
+          s03 = _mm256_fmadd_ps(a0, b, s03);
+          s13 = _mm256_fmadd_ps(a1, b, s13);
+      }
+
+      float *out0 = out;
+      float *out1 = out + ldo;
+      out0[0] = reduce_add_avx2(s00);
+      out0[1] = reduce_add_avx2(s01);
+      out0[2] = reduce_add_avx2(s02);
+      out0[3] = reduce_add_avx2(s03);
+      out1[0] = reduce_add_avx2(s10);
+      out1[1] = reduce_add_avx2(s11);
+      out1[2] = reduce_add_avx2(s12);
+      out1[3] = reduce_add_avx2(s13);
+      for (; i < dim; i++) {
+          out0[0] += x0[i] * y0[i];
+          out0[1] += x0[i] * y1[i];
+          out0[2] += x0[i] * y2[i];
+          out0[3] += x0[i] * y3[i];
+          out1[0] += x1[i] * y0[i];
+          out1[1] += x1[i] * y1[i];
+          out1[2] += x1[i] * y2[i];
+          out1[3] += x1[i] * y3[i];
+      }
+  }
+
+  // out[i * ldo + j] = <x[i], y_j> for nx gathered rows against ny rows of y stored back to back
+  ALP_TARGET_AVX2 static inline void inner_product_tile_avx2(const float *const *x, size_t nx, const float *y,
+                                                             size_t ny, int dim, float *out, size_t ldo) {
+      size_t i = 0;
+      for (; i + 2 <= nx; i += 2) {
+          size_t j = 0;
+          for (; j + 4 <= ny; j += 4) {
+              inner_product_2x4_avx2(x[i], x[i + 1], y + j * dim, dim, out + i * ldo + j, ldo);
+          }
+          for (; j < ny; ++j) {
+              out[i * ldo + j] = ip_distance_avx2(x[i], y + j * dim, dim);
+              out[(i + 1) * ldo + j] = ip_distance_avx2(x[i + 1], y + j * dim, dim);
+          }
+      }
+      for (; i < nx; ++i) {
+          size_t j = 0;
+          for (; j + 4 <= ny; j += 4) {
+              const float *yj = y + j * dim;
+              ip_distance_x4_avx2(x[i], yj, yj + dim, yj + 2 * dim, yj + 3 * dim, dim, out + i * ldo + j);
+          }
+          for (; j < ny; ++j) {
+              out[i * ldo + j] = ip_distance_avx2(x[i], y + j * dim, dim);
+          }
+      }
+  }
+
+  ALP_TARGET_AVX512 static inline float l2_distance_avx512(const float *a, const float *b, int size) {
+      __m512 sum0 = _mm512_setzero_ps();
+      __m512 sum1 = _mm512_setzero_ps();
+      int i = 0;
+
+      for (; i + 32 <= size; i += 32) {
+          __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+          __m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16));
+          sum0 = _mm512_fmadd_ps(d0, d0, sum0);
+          sum1 = _mm512_fmadd_ps(d1, d1, sum1);
+      }
+      for (; i < size; i += 16) {
+          // the masked load zero-fills past the end, so the tail needs no scalar loop
+          __mmask16 mask = size - i >= 16 ? 0xFFFF : static_cast<__mmask16>((1u << (size - i)) - 1);
+          __m512 d0 = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i));
+          sum0 = _mm512_fmadd_ps(d0, d0, sum0);
+      }
+      return _mm512_reduce_add_ps(_mm512_add_ps(sum0, sum1));
+  }
+
+  ALP_TARGET_AVX512 static inline float ip_distance_avx512(const float *a, const float *b, int size) {
+      __m512 sum0 = _mm512_setzero_ps();
+      __m512 sum1 = _mm512_setzero_ps();
+      int i = 0;
+
+      for (; i + 32 <= size; i += 32) {
+          sum0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), sum0);
+          sum1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), sum1);
+      }
+      for (; i < size; i += 16) {
+          __mmask16 mask = size - i >= 16 ? 0xFFFF : static_cast<__mmask16>((1u << (size - i)) - 1);
+          sum0 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i), sum0);
+      }
+      return _mm512_reduce_add_ps(_mm512_add_ps(sum0, sum1));
+  }
+
+  ALP_TARGET_AVX512 static inline float cosine_distance_avx512(const float *a, const float *b, int size) {
+      __m512 dot = _mm512_setzero_ps();
+      __m512 na = _mm512_setzero_ps();
+      __m512 nb = _mm512_setzero_ps();
+
+      for (int i = 0; i < size; i += 16) {
+          __mmask16 mask = size - i >= 16 ? 0xFFFF : static_cast<__mmask16>((1u << (size - i)) - 1);
+          __m512 va = _mm512_maskz_loadu_ps(mask, a + i);
+          __m512 vb = _mm512_maskz_loadu_ps(mask, b + i);
+          dot = _mm512_fmadd_ps(va, vb, dot);
+          na = _mm512_fmadd_ps(va, va, na);
+          nb = _mm512_fmadd_ps(vb, vb, nb);
+      }
+
+      float norm_a = _mm512_reduce_add_ps(na);
+      float norm_b = _mm512_reduce_add_ps(nb);
+      return _mm512_reduce_add_ps(dot) / (std::sqrt(norm_a) * std::sqrt(norm_b));
+  }
+
+  ALP_TARGET_AVX512 static inline void l2_distance_x4_avx512(const float *q, const float *y0, const float *y1,
+                                                             const float *y2, const float *y3, int size, float *out) {
+      __m512 s0 = _mm512_setzero_ps();
+      __m512 s1 = _mm512_setzero_ps();
+      __m512 s2 = _mm512_setzero_ps();
+      __m512 s3 = _mm512_setzero_ps();
+
+      for (int i = 0; i < size; i += 16) {
+          __mmask16 mask = size - i >= 16 ? 0xFFFF : static_cast<__mmask16>((1u << (size - i)) - 1);
+          __m512 vq = _mm512_maskz_loadu_ps(mask, q + i);
+          __m512 d0 = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, y0 + i), vq);
+          __m512 d1 = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, y1 + i), vq);
+          __m512 d2 = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, y2 + i), vq);
+          __m512 d3 = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, y3 + i), vq);
+          s0 = _mm512_fmadd_ps(d0, d0, s0);
+          s1 = _mm512_fmadd_ps(d1, d1, s1);
+          s2 = _mm512_fmadd_ps(d2, d2, s2);
+          s3 = _mm512_fmadd_ps(d3, d3, s3);
+      }
+
+      out[0] = _mm512_reduce_add_ps(s0);
+      out[1] = _mm512_reduce_add_ps(s1);
+      out[2] = _mm512_reduce_add_ps(s2);
+      out[3] = _mm512_reduce_add_ps(s3);
+  }
+
+  ALP_TARGET_AVX512 static inline void ip_distance_x4_avx512(const float *q, const float *y0, const float *y1,
+                                                             const float *y2, const float *y3, int size, float *out) {
+      __m512 s0 = _mm512_setzero_ps();
+      __m512 s1 = _mm512_setzero_ps();
+      __m512 s2 = _mm512_setzero_ps();
+      __m512 s3 = _mm512_setzero_ps();
+
+      for (int i = 0; i < size; i += 16) {
+          __mmask16 mask = size - i >= 16 ? 0xFFFF : static_cast<__mmask16>((1u << (size - i)) - 1);
+          __m512 vq = _mm512_maskz_loadu_ps(mask, q + i);
+          s0 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, y0 + i), vq, s0);
+          s1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, y1 + i), vq, s1);
+          s2 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, y2 + i), vq, s2);
+          s3 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, y3 + i), vq, s3);
+      }
+
+      out[0] = _mm512_reduce_add_ps(s0);
+      out[1] = _mm512_reduce_add_ps(s1);
+      out[2] = _mm512_reduce_add_ps(s2);
+      out[3] = _mm512_reduce_add_ps(s3);
+  }
+
+  ALP_TARGET_AVX512 static inline void cosine_distance_x4_avx512(const float *q, const float *y0, const float *y1,
+                                                                 const float *y2, const float *y3, int size,
+                                                                 float *out) {
+      out[0] = cosine_distance_avx512(q, y0, size);
+      out[1] = cosine_distance_avx512(q, y1, size);
+      out[2] = cosine_distance_avx512(q, y2, size);
+      out[3] = cosine_distance_avx512(q, y3, size);
+  }
+
+  template<int D>
+  ALP_TARGET_AVX512 static inline float l2_distance_avx512_dim(const float *a, const float *b, int) {
+      static_assert(D % 32 == 0);
+      __m512 sum0 = _mm512_setzero_ps();
+      __m512 sum1 = _mm512_setzero_ps();
+
+#pragma GCC unroll 8
+      for (int i = 0; i < D; i += 32) {
+          __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+          __m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16));
+          sum0 = _mm512_fmadd_ps(d0, d0, sum0);
+          sum1 = _mm512_fmadd_ps(d1, d1, sum1);
+      }
+      return _mm512_reduce_add_ps(_mm512_add_ps(sum0, sum1));
+  }
+
+  template<int D>
+  ALP_TARGET_AVX512 static inline float ip_distance_avx512_dim(const float *a, const float *b, int) {
+      static_assert(D % 32 == 0);
+      __m512 sum0 = _mm512_setzero_ps();
+      __m512 sum1 = _mm512_setzero_ps();
+
+#pragma GCC unroll 8
+      for (int i = 0; i < D; i += 32) {
+          sum0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), sum0);
+          sum1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), sum1);
+      }
+      return _mm512_reduce_add_ps(_mm512_add_ps(sum0, sum1));
+  }
+
+  template<int D>
+  ALP_TARGET_AVX512 static inline void l2_distance_x4_avx512_dim(const float *q, const float *y0, const float *y1,
+                                                                 const float *y2, const float *y3, int, float *out) {
+      l2_distance_x4_avx512(q, y0, y1, y2, y3, D, out);
+  }
+
+  template<int D>
+  ALP_TARGET_AVX512 static inline void ip_distance_x4_avx512_dim(const float *q, const float *y0, const float *y1,
+                                                                 const float *y2, const float *y3, int, float *out) {
+      ip_distance_x4_avx512(q, y0, y1, y2, y3, D, out);
+  }
+
+  template<auto kernel, auto kernel_x4, typename Rows>
+  ALP_TARGET_AVX512 static inline void distance_batch_avx512(const float *query, Rows rows, size_t n, int size,
+                                                             const uint8_t *mask, float *out) {
+      size_t i = 0;
+      for (; i + 4 <= n; i += 4) {
+          if (mask == nullptr || bitmap_test4(mask, i)) {
+              kernel_x4(query, rows(i), rows(i + 1), rows(i + 2), rows(i + 3), size, out + i);
+              continue;
+          }
+          for (size_t j = i; j < i + 4; ++j) {
+              if (bitmap_test(mask, j)) {
+                  out[j] = kernel(query, rows(j), size);
+              }
+          }
+      }
+      for (; i < n; ++i) {
+          if (mask == nullptr || bitmap_test(mask, i)) {
+              out[i] = kernel(query, rows(i), size);
+          }
+      }
+  }
+
+  ALP_TARGET_AVX512 static inline void inner_product_2x4_avx512(const float *x0, const float *x1, const float *y,
+                                                                int dim, float *out, size_t ldo) {
+      const float *y0 = y;
+      const float *y1 = y + dim;
+      const float *y2 = y + 2 * dim;
+      const float *y3 = y + 3 * dim;
+      __m512 s00 = _mm512_setzero_ps(), s01 = _mm512_setzero_ps(), s02 = _mm512_setzero_ps(), s03 = _mm512_setzero_ps();
+      __m512 s10 = _mm512_setzero_ps(), s11 = _mm512_setzero_ps(), s12 = _mm512_setzero_ps(), s13 = _mm512_setzero_ps();
+
+      for (int i = 0; i < dim; i += 16) {
+          __mmask16 mask = dim - i >= 16 ? 0xFFFF : static_cast<__mmask16>((1u << (dim - i)) - 1);
+          __m512 a0 = _mm512_maskz_loadu_ps(mask, x0 + i);
+          __m512 a1 = _mm512_maskz_loadu_ps(mask, x1 + i);
+          __m512 b = _mm512_maskz_loadu_ps(mask, y0 + i);
+          s00 = _mm512_fmadd_ps(a0, b, s00);
+          s10 = _mm512_fmadd_ps(a1, b, s10);
+          b = _mm512_maskz_loadu_ps(mask, y1 + i);
+          s01 = _mm512_fmadd_ps(a0, b, s01);
+          s11 = _mm512_fmadd_ps(a1, b, s11);
+          b = _mm512_maskz_loadu_ps(mask, y2 + i);
+          s02 = _mm512_fmadd_ps(a0, b, s02);
+          s12 = _mm512_fmadd_ps(a1, b, s12);
+          b = _mm512_maskz_loadu_ps(mask, y3 + i);
+          s03 = _mm512_fmadd_ps(a0, b, s03);
+          s13 = _mm512_fmadd_ps(a1, b, s13);
+      }
+
+      out[0] = _mm512_reduce_add_ps(s00);
+      out[1] = _mm512_reduce_add_ps(s01);
+      out[2] = _mm512_reduce_add_ps(s02);
+      out[3] = _mm512_reduce_add_ps(s03);
+      out[ldo] = _mm512_reduce_add_ps(s10);
+      out[ldo + 1] = _mm512_reduce_add_ps(s11);
+      out[ldo + 2] = _mm512_reduce_add_ps(s12);
+      out[ldo + 3] = _mm512_reduce_add_ps(s13);
+  }
+
+  ALP_TARGET_AVX512 static inline void inner_product_tile_avx512(const float *const *x, size_t nx, const float *y,
+                                                                 size_t ny, int dim, float *out, size_t ldo) {
+      size_t i = 0;
+      for (; i + 2 <= nx; i += 2) {
+          size_t j = 0;
+          for (; j + 4 <= ny; j += 4) {
+              inner_product_2x4_avx512(x[i], x[i + 1], y + j * dim, dim, out + i * ldo + j, ldo);
+          }
+          for (; j < ny; ++j) {
+              out[i * ldo + j] = ip_distance_avx512(x[i], y + j * dim, dim);
+              out[(i + 1) * ldo + j] = ip_distance_avx512(x[i + 1], y + j * dim, dim);
+          }
+      }
+      for (; i < nx; ++i) {
+          size_t j = 0;
+          for (; j + 4 <= ny; j += 4) {
+              const float *yj = y + j * dim;
+              ip_distance_x4_avx512(x[i], yj, yj + dim, yj + 2 * dim, yj + 3 * dim, dim, out + i * ldo + j);
+          }
+          for (; j < ny; ++j) {
+              out[i * ldo + j] = ip_distance_avx512(x[i], y + j * dim, dim);
+          }
+      }
+  }
+
+  // Loaders turning scalar quantizer codes into floats, fp16 and bf16 codes are passed as their raw 16 bits.
+  struct FloatCodes {
+      using code_type = float;
+
+      static float to_float(float code) {
+          return code;
+      }
+
+      ALP_TARGET_AVX2 static __m256 load_avx2(const float *code) {
+          return _mm256_loadu_ps(code);
+      }
+
+      ALP_TARGET_AVX512 static __m512 load_avx512(__mmask16 mask, const float *code) {
+          return _mm512_maskz_loadu_ps(mask, code);
+      }
+  };
+
+  struct Int8Codes {
+      using code_type = int8_t;
+
+      static float to_float(int8_t code) {
+          return code;
+      }
+
+      ALP_TARGET_AVX2 static __m256 load_avx2(const int8_t *code) {
+          __m128i bytes = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(code));
+          return _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(bytes));
+      }
+
+      ALP_TARGET_AVX512 static __m512 load_avx512(__mmask16 mask, const int8_t *code) {
+          return _mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(_mm_maskz_loadu_epi8(mask, code)));
+      }
+  };
+
+  struct FP16Codes {
+      using code_type = uint16_t;
+
+      ALP_TARGET_AVX2 static float to_float(uint16_t code) {
+          return _cvtsh_ss(code);
+      }
+
+      ALP_TARGET_AVX2 static __m256 load_avx2(const uint16_t *code) {
+          return _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i *>(code)));
+      }
+
+      ALP_TARGET_AVX512 static __m512 load_avx512(__mmask16 mask, const uint16_t *code) {
+          return _mm512_cvtph_ps(_mm256_maskz_loadu_epi16(mask, code));
+      }
+  };
+
+  struct BF16Codes {
+      using code_type = uint16_t;
+
+      static float to_float(uint16_t code) {
+          uint32_t bits = static_cast<uint32_t>(code) << 16;
+          float value;
+          std::memcpy(&value, &bits, sizeof(value));
+          return value;
+      }
+
+      ALP_TARGET_AVX2 static __m256 load_avx2(const uint16_t *code) {
+          __m256i wide = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(code)));
+          return _mm256_castsi256_ps(_mm256_slli_epi32(wide, 16));
+      }
+
+      ALP_TARGET_AVX512 static __m512 load_avx512(__mmask16 mask, const uint16_t *code) {
+          __m512i wide = _mm512_cvtepu16_epi32(_mm256_maskz_loadu_epi16(mask, code));
+          return _mm512_castsi512_ps(_mm512_slli_epi32(wide, 16));
+      }
+  };
+
+  // sum of (r_i - scale * code_i)^2, r is the query with everything but the scaled code already subtracted
+  template<typename Codes, typename T>
+  ALP_TARGET_AVX2 static inline float sq_l2_distance_avx2(const float *r, const T *code_ptr, int size, float scale) {
+      auto code = reinterpret_cast<const typename Codes::code_type *>(code_ptr);
+      __m256 vs = _mm256_set1_ps(scale);
+      __m256 sum0 = _mm256_setzero_ps();
+      __m256 sum1 = _mm256_setzero_ps();
+      int i = 0;
+
+      for (; i + 16 <= size; i += 16) {
+          __m256 d0 = _mm256_fnmadd_ps(Codes::load_avx2(code + i), vs, _mm256_loadu_ps(r + i));
+          __m256 d1 = _mm256_fnmadd_ps(Codes::load_avx2(code + i + 8), vs, _mm256_loadu_ps(r + i + 8));
+          sum0 = _mm256_fmadd_ps(d0, d0, sum0);
+          sum1 = _mm256_fmadd_ps(d1, d1, sum1);
+      }
+      if (i + 8 <= size) {
+          __m256 d0 = _mm256_fnmadd_ps(Codes::load_avx2(code + i), vs, _mm256_loadu_ps(r + i));
+          sum0 = _mm256_fmadd_ps(d0, d0, sum0);
+          i += 8;
+      }
+
+      float sum = reduce_add_avx2(_mm256_add_ps(sum0, sum1));
+      for (; i < size; i++) {
+          float diff = r[i] - scale * Codes::to_float(code[i]);
+          sum += diff * diff;
+      }
+      return sum;
+  }
+
+  // sum of q_i * code_i
+  template<typename Codes, typename T>
+  ALP_TARGET_AVX2 static inline float sq_ip_distance_avx2(const float *q, const T *code_ptr, int size) {
+      auto code = reinterpret_cast<const typename Codes::code_type *>(code_ptr);
+      __m256 sum0 = _mm256_setzero_ps();
+      __m256 sum1 = _mm256_setzero_ps();
+      int i = 0;
+
+      for (; i + 16 <= size; i += 16) {
+          sum0 = _mm256_fmadd_ps(Codes::load_avx2(code + i), _mm256_loadu_ps(q + i), sum0);
+          sum1 = _mm256_fmadd_ps(Codes::load_avx2(code + i + 8), _mm256_loadu_ps(q + i + 8), sum1);
+      }
+      if (i + 8 <= size) {
+          sum0 = _mm256_fmadd_ps(Codes::load_avx2(code + i), _mm256_loadu_ps(q + i), sum0);
+          i += 8;
+      }
+
+      float sum = reduce_add_avx2(_mm256_add_ps(sum0, sum1));
+      for (; i < size; i++) {
+          sum += q[i] * Codes::to_float(code[i]);
+      }
+      return sum;
+  }
+
+  template<typename Codes, typename T>
+  ALP_TARGET_AVX512 static inline float sq_l2_distance_avx512(const float *r, const T *code_ptr, int size,
+                                                              float scale) {
+      auto code = reinterpret_cast<const typename Codes::code_type *>(code_ptr);
+      __m512 vs = _mm512_set1_ps(scale);
+      __m512 sum = _mm512_setzero_ps();
+
+      for (int i = 0; i < size; i += 16) {
+          __mmask16 mask = size - i >= 16 ? 0xFFFF : static_cast<__mmask16>((1u << (size - i)) - 1);
+          __m512 d = _mm512_fnmadd_ps(Codes::load_avx512(mask, code + i), vs, _mm512_maskz_loadu_ps(mask, r + i));
+          sum = _mm512_fmadd_ps(d, d, sum);
+      }
+      return _mm512_reduce_add_ps(sum);
+  }
+
+  template<typename Codes, typename T>
+  ALP_TARGET_AVX512 static inline float sq_ip_distance_avx512(const float *q, const T *code_ptr, int size) {
+      auto code = reinterpret_cast<const typename Codes::code_type *>(code_ptr);
+      __m512 sum = _mm512_setzero_ps();
+
+      for (int i = 0; i < size; i += 16) {
+          __mmask16 mask = size - i >= 16 ? 0xFFFF : static_cast<__mmask16>((1u << (size - i)) - 1);
+          sum = _mm512_fmadd_ps(Codes::load_avx512(mask, code + i), _mm512_maskz_loadu_ps(mask, q + i), sum);
+      }
+      return _mm512_reduce_add_ps(sum);
+  }
+
+  // L2 between two int8 code vectors, exact in int32 for any practical dimension
+  ALP_TARGET_AVX2 static inline float l2_distance_int8_avx2(const int8_t *a, const int8_t *b, int size) {
+      __m256i sum = _mm256_setzero_si256();
+      int i = 0;
+
+      for (; i + 16 <= size; i += 16) {
+          __m256i va = _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i)));
+          __m256i vb = _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i)));
+          __m256i d = _mm256_sub_epi16(va, vb);
+          sum = _mm256_add_epi32(sum, _mm256_madd_epi16(d, d));
+      }
+
+      __m128i lo = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+      lo = _mm_add_epi32(lo, _mm_shuffle_epi32(lo, _MM_SHUFFLE(1, 0, 3, 2)));
+      lo = _mm_add_epi32(lo, _mm_shuffle_epi32(lo, _MM_SHUFFLE(2, 3, 0, 1)));
+      int32_t total = _mm_cvtsi128_si32(lo);
+      for (; i < size; i++) {
+          int32_t d = a[i] - b[i];
+          total += d * d;
+      }
+      return static_cast<float>(total);
+  }
+
+  ALP_TARGET_AVX512_VNNI static inline float l2_distance_int8_vnni(const int8_t *a, const int8_t *b, int size) {
+      __m512i sum = _mm512_setzero_si512();
+
+      for (int i = 0; i < size; i += 32) {
+          __mmask32 mask = size - i >= 32 ? 0xFFFFFFFFu : static_cast<__mmask32>((1u << (size - i)) - 1);
+          __m512i va = _mm512_cvtepi8_epi16(_mm256_maskz_loadu_epi8(mask, a + i));
+          __m512i vb = _mm512_cvtepi8_epi16(_mm256_maskz_loadu_epi8(mask, b + i));
+          __m512i d = _mm512_sub_epi16(va, vb);
+          sum = _mm512_dpwssd_epi32(sum, d, d);
+      }
+      return static_cast<float>(_mm512_reduce_add_epi32(sum));
+  }
+
+
+  // Product quantizer lookups, eight or sixteen table entries of a code come from a single gather
+  ALP_TARGET_AVX2 static inline float pq_adc_distance_avx2(const float *table, const uint8_t *code, int m) {
+      const __m256i offsets = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+                                                 _mm256_set1_epi32(kPQTableStride));
+      __m256 sum = _mm256_setzero_ps();
+      int i = 0;
+
+      for (; i + 8 <= m; i += 8) {
+          __m256i idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(code + i)));
+          sum = _mm256_add_ps(sum, _mm256_i32gather_ps(table + i * kPQTableStride,
+                                                       _mm256_add_epi32(idx, offsets), 4));
+      }
+
+      float total = reduce_add_avx2(sum);
+      for (; i < m; i++) {
+          total += table[i * kPQTableStride + code[i]];
+      }
+      return total;
+  }
+
+  ALP_TARGET_AVX512 static inline float pq_adc_distance_avx512(const float *table, const uint8_t *code, int m) {
+      const __m512i offsets = _mm512_mullo_epi32(
+              _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15),
+              _mm512_set1_epi32(kPQTableStride));
+      __m512 sum = _mm512_setzero_ps();
+
+      for (int i = 0; i < m; i += 16) {
+          __mmask16 mask = m - i >= 16 ? 0xFFFF : static_cast<__mmask16>((1u << (m - i)) - 1);
+          __m512i idx = _mm512_add_epi32(_mm512_cvtepu8_epi32(_mm_maskz_loadu_epi8(mask, code + i)), offsets);
+          sum = _mm512_add_ps(sum, _mm512_mask_i32gather_ps(_mm512_setzero_ps(), mask, idx,
+                                                            table + i * kPQTableStride, 4));
+      }
+      return _mm512_reduce_add_ps(sum);
+  }
+
+
+  // 4-bit product quantizer fast scan of one block of 32 codes, see PackedInvertedList for the layout. Every
+  // pair of sub quantizers is one 32 byte register of codes looked up in a 32 byte register of uint8 tables, the
+  // low nibbles give rows 0-15 and the high nibbles rows 16-31. Even and odd bytes are accumulated separately as
+  // saturating uint16 and interleaved back into row order at the end.
+  // saturating sum of the 128 bit lanes
+  ALP_TARGET_AVX2 static inline __m128i fold_adds_epu16_avx2(__m256i v) {
+      return _mm_adds_epu16(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+  }
+
+  ALP_TARGET_AVX512 static inline __m128i fold_adds_epu16_avx512(__m512i v) {
+      __m256i half = _mm256_adds_epu16(_mm512_castsi512_si256(v), _mm512_extracti64x4_epi64(v, 1));
+      return _mm_adds_epu16(_mm256_castsi256_si128(half), _mm256_extracti128_si256(half, 1));
+  }
+
+  ALP_TARGET_AVX2 static inline void pq4_scan_block_avx2(const uint8_t *lut, const uint8_t *block, int pairs,
+                                                         uint16_t *out) {
+      const __m256i low4 = _mm256_set1_epi8(0x0F);
+      const __m256i low8 = _mm256_set1_epi16(0x00FF);
+      __m256i acc_lo_even = _mm256_setzero_si256();
+      __m256i acc_lo_odd = _mm256_setzero_si256();
+      __m256i acc_hi_even = _mm256_setzero_si256();
+      __m256i acc_hi_odd = _mm256_setzero_si256();
+
+      for (int p = 0; p < pairs; ++p) {
+          __m256i codes = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(block + p * 32));
+          __m256i table = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(lut + p * 32));
+          __m256i lo = _mm256_shuffle_epi8(table, _mm256_and_si256(codes, low4));
+          __m256i hi = _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(codes, 4), low4));
+          acc_lo_even = _mm256_adds_epu16(acc_lo_even, _mm256_and_si256(lo, low8));
+          acc_lo_odd = _mm256_adds_epu16(acc_lo_odd, _mm256_srli_epi16(lo, 8));
+          acc_hi_even = _mm256_adds_epu16(acc_hi_even, _mm256_and_si256(hi, low8));
+          acc_hi_odd = _mm256_adds_epu16(acc_hi_odd, _mm256_srli_epi16(hi, 8));
+      }
+
+      __m128i lo_even = fold_adds_epu16_avx2(acc_lo_even), lo_odd = fold_adds_epu16_avx2(acc_lo_odd);
+      __m128i hi_even = fold_adds_epu16_avx2(acc_hi_even), hi_odd = fold_adds_epu16_avx2(acc_hi_odd);
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(out), _mm_unpacklo_epi16(lo_even, lo_odd));
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 8), _mm_unpackhi_epi16(lo_even, lo_odd));
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 16), _mm_unpacklo_epi16(hi_even, hi_odd));
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 24), _mm_unpackhi_epi16(hi_even, hi_odd));
+  }
+
+  // two pairs of sub quantizers per 64 byte register, an odd last pair is loaded into the lower 256 bits with the
+  // upper half zeroed
+  ALP_TARGET_AVX512 static inline void pq4_scan_block_avx512(const uint8_t *lut, const uint8_t *block, int pairs,
+                                                             uint16_t *out) {
+      const __m512i low4 = _mm512_set1_epi8(0x0F);
+      const __m512i low8 = _mm512_set1_epi16(0x00FF);
+      __m512i acc_lo_even = _mm512_setzero_si512();
+      __m512i acc_lo_odd = _mm512_setzero_si512();
+      __m512i acc_hi_even = _mm512_setzero_si512();
+      __m512i acc_hi_odd = _mm512_setzero_si512();
+
+      for (int p = 0; p < pairs; p += 2) {
+          __mmask64 mask = pairs - p >= 2 ? ~0ull : 0xFFFFFFFFull;
+          __m512i codes = _mm512_maskz_loadu_epi8(mask, block + p * 32);
+          __m512i table = _mm512_maskz_loadu_epi8(mask, lut + p * 32);
+          __m512i lo = _mm512_shuffle_epi8(table, _mm512_and_si512(codes, low4));
+          __m512i hi = _mm512_shuffle_epi8(table, _mm512_and_si512(_mm512_srli_epi16(codes, 4), low4));
+          acc_lo_even = _mm512_adds_epu16(acc_lo_even, _mm512_and_si512(lo, low8));
+          acc_lo_odd = _mm512_adds_epu16(acc_lo_odd, _mm512_srli_epi16(lo, 8));
+          acc_hi_even = _mm512_adds_epu16(acc_hi_even, _mm512_and_si512(hi, low8));
+          acc_hi_odd = _mm512_adds_epu16(acc_hi_odd, _mm512_srli_epi16(hi, 8));
+      }
+
+      __m128i lo_even = fold_adds_epu16_avx512(acc_lo_even), lo_odd = fold_adds_epu16_avx512(acc_lo_odd);
+      __m128i hi_even = fold_adds_epu16_avx512(acc_hi_even), hi_odd = fold_adds_epu16_avx512(acc_hi_odd);
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(out), _mm_unpacklo_epi16(lo_even, lo_odd));
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 8), _mm_unpackhi_epi16(lo_even, lo_odd));
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 16), _mm_unpacklo_epi16(hi_even, hi_odd));
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 24), _mm_unpackhi_epi16(hi_even, hi_odd));
+  }
+
+#endif
+
+}
@@ -1,8 +1,11 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <functional>
 #include <future>
 #include <thread>
+#include <vector>
 #include "concurrent_queue.h"
 
 namespace alp {
@@ -51,6 +54,10 @@ namespace alp {
           }
       }
 
+      size_t size() const {
+          return background_threads_.size();
+      }
+
       template<typename Fun, typename Ret = std::invoke_result_t<std::decay_t<Fun>>>
       std::future<Ret> submit(Fun &&fun) {
           std::promise<Ret> p;
@@ -79,4 +86,41 @@ namespace alp {
       std::vector<std::jthread> background_threads_;
   };
 
+  // Calls fun(begin, end, worker) for chunks of grain indices of [0, n) until all are claimed, with one worker per
+  // executor thread plus the calling thread and returns once every chunk is done. Without an executor the whole
+  // range runs inline as worker 0. Workers are numbered below parallel_workers(executor, n, grain).
+  static inline size_t parallel_workers(const Executor *executor, size_t n, size_t grain) {
+      size_t chunks = (n + grain - 1) / grain;
+      return std::max<size_t>(1, std::min(executor == nullptr ? 1 : executor->size() + 1, chunks));
+  }
+
+  template<typename Fun>
+  void parallel_for(Executor *executor, size_t n, size_t grain, Fun &&fun) {
+      grain = std::max<size_t>(1, grain);
+      size_t workers = parallel_workers(executor, n, grain);
+      if (workers == 1) {
+          if (n > 0) {
+              fun(size_t(0), n, size_t(0));
+          }
+          return;
+      }
+
+      std::atomic<size_t> next{0};
+      auto work = [&](size_t worker) {
+          for (size_t begin = next.fetch_add(grain); begin < n; begin = next.fetch_add(grain)) {
+              fun(begin, std::min(n, begin + grain), worker);
+          }
+      };
+
+      std::vector<std::future<void>> futures;
+      futures.reserve(workers - 1);
+      for (size_t w = 1; w < workers; ++w) {
+          futures.push_back(executor->submit([&work, w] { work(w); }));
+      }
+      work(0);
+      for (auto &f: futures) {
+          f.get();
+      }
+  }
+
 }// namespace alp
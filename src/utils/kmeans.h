@@ -4,8 +4,17 @@
 #include <random>
 #include <unordered_set>
 #include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cmath>
+#include <limits>
+#include <numeric>
+#include <queue>
 
 #include "utils/distance.h"
+#include "utils/executor.h"
+#include "utils/pairwise_distance.h"
+#include "utils/status.h"
 
 namespace alp {
 
@@ -43,7 +52,7 @@ namespace alp {
 
       void clear() {
           average_.clear();
-          residual_.clear();
+          residual_.assign(dim_, 0);
           count_ = 0;
       }
 
@@ -56,13 +65,60 @@ namespace alp {
   template<typename vec_t>
   struct KMeans {
       KMeans(int k, int max_iters, float tolerance, size_t dim, DistanceType type = L2)
-              : k(k), max_iters(max_iters), tolerance(tolerance), distance_calc_(type), dim_(dim) {
+              : k(k), max_iters(max_iters), tolerance(tolerance), distance_type_(type),
+                distance_calc_(type, static_cast<int>(dim)), dim_(dim) {
       }
 
       void add(data_ptr<vec_t> data) {
           data_.push_back(data);
       }
 
+      // runs the assignment and accumulation of every iteration on the executor, nullptr trains inline
+      void set_executor(Executor *executor) {
+          executor_ = executor;
+      }
+
+      // trains on a random sample of at most points_per_centroid * k of the added rows, 0 trains on all of them
+      void set_max_points_per_centroid(size_t points_per_centroid) {
+          max_points_per_centroid_ = points_per_centroid;
+      }
+
+      // bounds the distances of every row with Hamerly's method so that most rows skip the scan of all
+      // centroids once the assignments settle, same result as Lloyd iterations, L2 only
+      void set_hamerly(bool enable) {
+          hamerly_ = enable;
+      }
+
+      // keeps clusters within about max_ratio (> 1) times the mean size by splitting the big ones with the centroids of
+      // the smallest during Lloyd iterations, 0 turns it off. Balanced training runs full Lloyd iterations, without
+      // Hamerly bounds or mini-batches, and the last one only updates so the centroids are the means of their rows.
+      void set_balance(double max_ratio) {
+          // a ratio of 1 or less lets a cluster be split with its own centroid
+          assert(max_ratio == 0 || max_ratio > 1);
+          balance_ = max_ratio;
+      }
+
+      // Sculley's mini-batch k-means: every iteration assigns batch_size random rows and moves their centroids
+      // towards them with a per-centroid rate of 1 / rows seen so far, max_iters is the number of batches.
+      // 0 runs full Lloyd iterations, as does balanced training.
+      void set_mini_batch(size_t batch_size) {
+          batch_size_ = batch_size;
+      }
+
+      // drops all but a random sample of the rows when there are more than the training limit
+      void subsample() {
+          size_t limit = max_points_per_centroid_ * std::max(k, 1);
+          if (max_points_per_centroid_ == 0 || data_.size() <= limit) {
+              return;
+          }
+          std::mt19937 gen(std::random_device{}());
+          for (size_t i = 0; i < limit; ++i) {
+              std::uniform_int_distribution<size_t> dist(i, data_.size() - 1);
+              std::swap(data_[i], data_[dist(gen)]);
+          }
+          data_.resize(limit);
+          data_.shrink_to_fit();
+      }
 
       std::vector<std::vector<vec_t>> centroids() {
           return std::move(centroids_datas_);
@@ -81,12 +137,10 @@ namespace alp {
 
           k = std::min(k, static_cast<int>(data_.size()));
 
-          centroids_.assign(data_.begin(), data_ + k);
+          centroids_.assign(data_.begin(), data_.begin() + k);
 
           std::mt19937 gen(std::random_device{}());
 
-          std::unordered_set<size_t> selected;
-
 
           for (auto m = k; m < data_.size(); ++m) {
               std::uniform_int_distribution<> dist(0, m);
@@ -105,84 +159,309 @@ namespace alp {
 
 
       void train() {
+          subsample();
+          if (data_.empty()) {
+              return;
+          }
           if (!is_centroid) {
               init_centroids();
           }
-          for (const auto &data: data_) {
-              int best_centroid = -1;
-              float best_distance = std::numeric_limits<float>::max();
 
-              for (int j = 0; j < k; ++j) {
-                  float distance = distance_calc_(data->data(), centroids_[j]->data(), dim_);
-                  if (distance < best_distance) {
-                      best_distance = distance;
-                      best_centroid = j;
-                  }
-              }
+          k = static_cast<int>(centroids_.size());
+          centroids_datas_.clear();
+          centroids_datas_.reserve(k);
+          for (const auto &c: centroids_) {
+              centroids_datas_.emplace_back(c, c + dim_);
+          }
+          centroids_.clear();
 
-              trained_centroids_[best_centroid].add(data->data());
+          if (batch_size_ > 0 && balance_ == 0) {
+              train_mini_batch();
+              return;
+          }
+          if (hamerly_ && distance_type_ == L2 && balance_ == 0) {
+              train_hamerly();
+              return;
           }
-          bool converged = true;
 
-          for (int j = 0; j < k; ++j) {
-              auto &centroid = trained_centroids_[j];
-              auto &old_centroid = centroids_[j];
+          PairwiseDistance<vec_t> pairwise(distance_type_, dim_);
+          std::vector<vec_t> flat_centroids(k * dim_);
+          std::vector<int64_t> labels(data_.size());
+          std::vector<float> distances(data_.size());
 
-              float distance = distance_calc_(centroid.average_.data(), old_centroid->data(), dim_);
+          // workers assign chunks of rows, the centroids are then averaged from their rows in parallel
+          size_t n = data_.size();
+          std::vector<size_t> counts(k);
 
-              centroids_datas_[j] = std::move(centroid.average_);
-              centroid.clear();
-              if (distance > tolerance) {
+          for (int iter = 0; iter < max_iters; ++iter) {
+              copy_centroids(flat_centroids.data());
+              pairwise.set_base(flat_centroids.data(), k);
+
+              parallel_for(executor_, n, kTrainGrain, [&](size_t begin, size_t end, size_t) {
+                  pairwise.nearest(data_.data() + begin, end - begin, labels.data() + begin,
+                                   distances.data() + begin);
+              });
+
+              bool converged = update_centroids(labels.data(), counts.data(), nullptr);
+              // no split after the last assignment, it would leave the moved centroids without rows
+              if (balance_ > 0 && iter + 1 < max_iters && rebalance(counts.data(), n)) {
                   converged = false;
               }
+              if (converged) {
+                  break;
+              }
           }
+      }
 
-          if (converged) {
-              return;
-          }
+      // Hamerly's k-means. Every row keeps an upper bound on the distance to its centroid and a lower bound on
+      // the distance to any other centroid, the bounds follow the centroid moves through the triangle inequality
+      // and a row is only rescanned once they stop proving its assignment. Bounds are on the distances, not on
+      // the squared distances the calculators return.
+      void train_hamerly() {
+          size_t n = data_.size();
+          PairwiseDistance<vec_t> pairwise(L2, dim_);
+          std::vector<vec_t> flat_centroids(k * dim_);
+          copy_centroids(flat_centroids.data());
+          pairwise.set_base(flat_centroids.data(), k);
+
+          std::vector<int64_t> labels(n);
+          std::vector<float> upper(n);
+          std::vector<float> lower(n);
+          parallel_for(executor_, n, kTrainGrain, [&](size_t begin, size_t end, size_t) {
+              std::vector<int64_t> nn((end - begin) * 2);
+              std::vector<float> nn_dis((end - begin) * 2);
+              pairwise.knn(data_.data() + begin, end - begin, 2, nn.data(), nn_dis.data());
+              for (size_t i = begin; i < end; ++i) {
+                  labels[i] = nn[(i - begin) * 2];
+                  upper[i] = std::sqrt(nn_dis[(i - begin) * 2]);
+                  lower[i] = nn[(i - begin) * 2 + 1] < 0 ? std::numeric_limits<float>::max()
+                                                         : std::sqrt(nn_dis[(i - begin) * 2 + 1]);
+              }
+          });
 
-          centroids_.clear();
+          size_t workers = parallel_workers(executor_, n, kTrainGrain);
+          std::vector<size_t> counts(k);
+          std::vector<float> moved(k);
+          std::vector<float> half_gap(k);
+          std::vector<std::vector<float>> scans(workers, std::vector<float>(k));
 
-          for (int i = 1; i < max_iters; ++i) {
-              for (const auto &data: data_) {
-                  int best_centroid = -1;
-                  float best_distance = std::numeric_limits<float>::max();
+          for (int iter = 0; iter < max_iters; ++iter) {
+              if (update_centroids(labels.data(), counts.data(), moved.data())) {
+                  break;
+              }
+              copy_centroids(flat_centroids.data());
+              pairwise.set_base(flat_centroids.data(), k);
 
-                  for (int j = 0; j < k; ++j) {
-                      float distance = distance_calc_(data->data(), centroids_datas_[j].data(), dim_);
-                      if (distance < best_distance) {
-                          best_distance = distance;
-                          best_centroid = j;
-                      }
+              // a row's lower bound drops by the largest move among the centroids other than its own
+              size_t furthest = std::max_element(moved.begin(), moved.end()) - moved.begin();
+              float max_move = moved[furthest];
+              float second_move = 0;
+              for (int j = 0; j < k; ++j) {
+                  if (static_cast<size_t>(j) != furthest) {
+                      second_move = std::max(second_move, moved[j]);
                   }
-
-                  trained_centroids_[best_centroid].add(data->data());
               }
-              converged = true;
 
-              for (int j = 0; j < k; ++j) {
-                  auto &centroid = trained_centroids_[j];
-                  auto &old_centroid = centroids_datas_[j];
+              // half the distance from every centroid to its closest other centroid
+              parallel_for(executor_, k, kReduceGrain, [&](size_t begin, size_t end, size_t) {
+                  std::vector<int64_t> nn((end - begin) * 2);
+                  std::vector<float> nn_dis((end - begin) * 2);
+                  pairwise.knn(flat_centroids.data() + begin * dim_, end - begin, 2, nn.data(), nn_dis.data());
+                  for (size_t j = begin; j < end; ++j) {
+                      half_gap[j] = nn[(j - begin) * 2 + 1] < 0 ? std::numeric_limits<float>::max()
+                                                                : 0.5f * std::sqrt(nn_dis[(j - begin) * 2 + 1]);
+                  }
+              });
+
+              parallel_for(executor_, n, kTrainGrain, [&](size_t begin, size_t end, size_t worker) {
+                  float *scan = scans[worker].data();
+                  for (size_t i = begin; i < end; ++i) {
+                      auto a = labels[i];
+                      upper[i] += moved[a];
+                      lower[i] -= static_cast<size_t>(a) == furthest ? second_move : max_move;
+
+                      float bound = std::max(half_gap[a], lower[i]);
+                      if (upper[i] <= bound) {
+                          continue;
+                      }
+                      upper[i] = std::sqrt(distance_calc_(data_[i], flat_centroids.data() + a * dim_, dim_));
+                      if (upper[i] <= bound) {
+                          continue;
+                      }
 
-                  float distance = distance_calc_(centroid.average_.data(), old_centroid->data(), dim_);
-                  centroids_datas_[j] = std::move(centroid.average_);
-                  centroid.clear();
+                      distance_calc_.batch(data_[i], flat_centroids.data(), k, dim_, scan);
+                      float best = std::numeric_limits<float>::max();
+                      float second = std::numeric_limits<float>::max();
+                      int64_t best_label = a;
+                      for (int j = 0; j < k; ++j) {
+                          if (scan[j] < best) {
+                              second = best;
+                              best = scan[j];
+                              best_label = j;
+                          } else if (scan[j] < second) {
+                              second = scan[j];
+                          }
+                      }
+                      labels[i] = best_label;
+                      upper[i] = std::sqrt(best);
+                      lower[i] = std::sqrt(second);
+                  }
+              });
+          }
+      }
 
-                  if (distance > tolerance) {
-                      converged = false;
+      void train_mini_batch() {
+          PairwiseDistance<vec_t> pairwise(distance_type_, dim_);
+          std::vector<vec_t> flat_centroids(k * dim_);
+          size_t batch = std::min(batch_size_, data_.size());
+          std::vector<data_ptr<vec_t>> rows(batch);
+          std::vector<int64_t> labels(batch);
+          std::vector<float> distances(batch);
+          std::vector<size_t> seen(k, 0);
+
+          std::mt19937 gen(std::random_device{}());
+          std::uniform_int_distribution<size_t> pick(0, data_.size() - 1);
+          for (int iter = 0; iter < max_iters; ++iter) {
+              copy_centroids(flat_centroids.data());
+              pairwise.set_base(flat_centroids.data(), k);
+
+              for (auto &row: rows) {
+                  row = data_[pick(gen)];
+              }
+              parallel_for(executor_, batch, kTrainGrain, [&](size_t begin, size_t end, size_t) {
+                  pairwise.nearest(rows.data() + begin, end - begin, labels.data() + begin,
+                                   distances.data() + begin);
+              });
+
+              // the assignments are taken against the centroids of the start of the batch
+              for (size_t i = 0; i < batch; ++i) {
+                  auto &centroid = centroids_datas_[labels[i]];
+                  double rate = 1.0 / static_cast<double>(++seen[labels[i]]);
+                  for (size_t d = 0; d < dim_; ++d) {
+                      centroid[d] += static_cast<vec_t>(rate * (rows[i][d] - centroid[d]));
                   }
               }
+          }
+      }
 
-              if (converged) {
+      // Splits every cluster larger than balance_ times the mean size in two: the centroid of one of the smallest
+      // clusters, those below the mean over balance_, moves next to the centroid of the big one and both are
+      // nudged apart, its own rows go to their next closest centroids on the next assignment. The sizes are
+      // updated as if the split halved the big cluster. Returns whether a centroid moved.
+      bool rebalance(size_t *counts, size_t n) {
+          constexpr double kSplitEps = 1.0 / 1024;
+          double mean = static_cast<double>(n) / k;
+          double limit = balance_ * mean;
+
+          std::vector<int> small(k);
+          std::iota(small.begin(), small.end(), 0);
+          std::sort(small.begin(), small.end(), [counts](int a, int b) { return counts[a] < counts[b]; });
+          auto by_size = [counts](int a, int b) { return counts[a] < counts[b]; };
+          std::priority_queue<int, std::vector<int>, decltype(by_size)> big(by_size);
+          for (int j = 0; j < k; ++j) {
+              if (static_cast<double>(counts[j]) > limit) {
+                  big.push(j);
+              }
+          }
+
+          bool moved = false;
+          for (int donor: small) {
+              if (big.empty() || static_cast<double>(counts[donor]) * balance_ >= mean) {
                   break;
               }
+              int split = big.top();
+              big.pop();
+
+              auto &from = centroids_datas_[split];
+              auto &to = centroids_datas_[donor];
+              for (size_t d = 0; d < dim_; ++d) {
+                  double eps = d % 2 == 0 ? kSplitEps : -kSplitEps;
+                  to[d] = static_cast<vec_t>(from[d] * (1 + eps));
+                  from[d] = static_cast<vec_t>(from[d] * (1 - eps));
+              }
+              counts[donor] = counts[split] / 2;
+              counts[split] -= counts[donor];
+              for (int j: {split, donor}) {
+                  if (static_cast<double>(counts[j]) > limit) {
+                      big.push(j);
+                  }
+              }
+              moved = true;
           }
+          return moved;
+      }
+
+      void copy_centroids(vec_t *flat) const {
+          for (int j = 0; j < k; ++j) {
+              std::copy(centroids_datas_[j].begin(), centroids_datas_[j].end(), flat + j * dim_);
+          }
+      }
+
+      // Moves every centroid to the mean of the rows labelled with it and returns whether none of them moved by
+      // more than the tolerance, moved gets the distance each one moved if given and counts the cluster sizes.
+      // The rows are grouped by label with a counting sort first so that every centroid is summed by one worker,
+      // which keeps the scratch memory at O(n + k) whatever the number of workers.
+      bool update_centroids(const int64_t *labels, size_t *counts, float *moved) {
+          size_t n = data_.size();
+          std::vector<size_t> offsets(k + 1, 0);
+          for (size_t i = 0; i < n; ++i) {
+              offsets[labels[i] + 1]++;
+          }
+          for (int j = 0; j < k; ++j) {
+              counts[j] = offsets[j + 1];
+              offsets[j + 1] += offsets[j];
+          }
+          std::vector<size_t> rows(n);
+          {
+              auto fill = offsets;
+              for (size_t i = 0; i < n; ++i) {
+                  rows[fill[labels[i]]++] = i;
+              }
+          }
+
+          std::atomic<bool> converged{true};
+          parallel_for(executor_, k, kReduceGrain, [&](size_t begin, size_t end, size_t) {
+              std::vector<double> sum(dim_);
+              std::vector<vec_t> average(dim_);
+              for (size_t j = begin; j < end; ++j) {
+                  // an empty cluster keeps its previous centroid
+                  if (counts[j] == 0) {
+                      if (moved != nullptr) {
+                          moved[j] = 0;
+                      }
+                      continue;
+                  }
+
+                  std::fill(sum.begin(), sum.end(), 0.0);
+                  for (size_t r = offsets[j]; r < offsets[j + 1]; ++r) {
+                      const vec_t *row = data_[rows[r]];
+                      for (size_t d = 0; d < dim_; ++d) {
+                          sum[d] += row[d];
+                      }
+                  }
+                  double inv = 1.0 / static_cast<double>(counts[j]);
+                  for (size_t d = 0; d < dim_; ++d) {
+                      average[d] = static_cast<vec_t>(sum[d] * inv);
+                  }
+                  float distance = l2_distance<vec_t>(average.data(), centroids_datas_[j].data(), dim_);
+                  std::copy(average.begin(), average.end(), centroids_datas_[j].begin());
+                  if (moved != nullptr) {
+                      moved[j] = std::sqrt(distance);
+                  }
+                  if (distance > tolerance) {
+                      converged.store(false, std::memory_order_relaxed);
+                  }
+              }
+          });
+          return converged.load();
       }
 
       int k;
       int max_iters;
       float tolerance;
 
+      DistanceType distance_type_;
+
       DistanceCalc<vec_t> distance_calc_;
 
       bool is_centroid = false;
@@ -191,101 +470,278 @@ namespace alp {
 
       std::vector<std::vector<vec_t>> centroids_datas_;
 
-      std::vector<Kahan_Average<vec_t>> trained_centroids_;
-
       size_t dim_;
 
       std::vector<data_ptr<vec_t>> data_;
+
+      Executor *executor_ = nullptr;
+
+      size_t max_points_per_centroid_ = 0;
+
+      size_t batch_size_ = 0;
+
+      bool hamerly_ = false;
+
+      double balance_ = 0;
+
+  private:
+      // rows assigned per claim of a worker, centroids reduced per claim
+      static constexpr size_t kTrainGrain = 4096;
+      static constexpr size_t kReduceGrain = 64;
   };
 
   template<typename vec_t>
   struct KMeansPP {
 
       KMeansPP(int k, size_t dim, int max_iters = 100, float tolerance = 1e-4, DistanceType type = L2)
-              : means_(k, max_iters, tolerance, type) {}
+              : means_(k, max_iters, tolerance, dim, type) {}
+
+      // seeds the centroids from data by D^2 sampling, with k-means|| when parallel seeding is set
       void centroids_pp(const std::vector<data_ptr<vec_t>> &data) {
           if (data.empty()) {
               return;
           }
 
-          is_pp = true;
-
           auto &centroids = means_.centroids_;
-
           centroids.clear();
 
-          std::uniform_int_distribution<> distrib(0, data.size() - 1);
-
+          size_t k = std::min(static_cast<size_t>(means_.k), data.size());
           std::mt19937 gen(std::random_device{}());
+          auto seeds = seed_rounds_ > 0 ? parallel_seeds(data, k, gen)
+                                        : plus_plus(data, nullptr, k, gen);
+          for (auto s: seeds) {
+              centroids.push_back(data[s]);
+          }
 
-          {
-              auto dist = distrib(gen);
+          means_.is_centroid = true;
+      }
 
-              centroids.push_back(data[dist]);
+      std::vector<std::vector<vec_t>> centroids() {
+          return means_.centroids();
+      }
 
-              std::unordered_set<size_t> selected;
+      void add(data_ptr<vec_t> data) {
+          means_.add(data);
+      }
+
+      void clear() {
+          means_.clear();
+      }
+
+      void set_executor(Executor *executor) {
+          means_.set_executor(executor);
+      }
+
+      void set_max_points_per_centroid(size_t points_per_centroid) {
+          means_.set_max_points_per_centroid(points_per_centroid);
+      }
 
-              selected.emplace(dist);
+      void set_mini_batch(size_t batch_size) {
+          means_.set_mini_batch(batch_size);
+      }
+
+      void set_hamerly(bool enable) {
+          means_.set_hamerly(enable);
+      }
+
+      void set_balance(double max_ratio) {
+          means_.set_balance(max_ratio);
+      }
+
+      // k-means|| seeding: each of rounds passes samples about oversampling * k rows with probability
+      // proportional to their squared distance to the candidates so far, the candidates weighted by the rows
+      // closest to them are then reduced to k by k-means++, or topped up to k by D^2 sampling when fewer were
+      // drawn. 0 rounds seeds with plain k-means++, otherwise rounds * oversampling must be at least 1.
+      Status set_parallel_seeding(int rounds = 2, double oversampling = 2.0) {
+          if (rounds < 0 || (rounds > 0 && !(rounds * oversampling >= 1))) {
+              return Status::InvalidArgument();
           }
+          seed_rounds_ = rounds;
+          oversampling_ = oversampling;
+          return Status::OK();
+      }
 
-          size_t k = std::min(static_cast<size_t>(means_.k), data.size());
+      void train() {
+          // the seeds are drawn from the training sample
+          means_.subsample();
+          if (is_pp) {
+              centroids_pp(means_.data_);
+          }
 
-          auto dim = means_.dim_;
+          means_.train();
+      }
 
-          auto &calc = means_.distance_calc_;
+      // seeds with k-means++, false leaves KMeans to pick random rows
+      bool is_pp = true;
+      KMeans<vec_t> means_;
 
-          for (int i = 1; i < k; ++i) {
-              std::vector<double> distances(data.size(), 0.0);
-              double totalDistance = 0.0;
+  private:
+      // rows of a chunk whose sum of distances is kept for the sampling
+      static constexpr size_t kSeedGrain = 4096;
+
+      // Draws k distinct rows with probability proportional to weight * squared distance to the closest row drawn
+      // before. The distances are kept per row and only compared against the newest seed, so every seed costs one
+      // pass over the rows, and the sums per chunk let the draw skip whole chunks.
+      std::vector<size_t> plus_plus(const std::vector<data_ptr<vec_t>> &data, const double *weights, size_t k,
+                                    std::mt19937 &gen) const {
+          size_t n = data.size();
+          std::vector<size_t> seeds;
+          seeds.reserve(k);
+          std::vector<float> min_dist(n, std::numeric_limits<float>::max());
+
+          if (weights == nullptr) {
+              seeds.push_back(std::uniform_int_distribution<size_t>(0, n - 1)(gen));
+          } else {
+              seeds.push_back(std::discrete_distribution<size_t>(weights, weights + n)(gen));
+          }
+          draw_seeds(data, weights, k, min_dist, seeds, gen);
+          return seeds;
+      }
 
-              for (size_t j = 0; j < data.size(); ++j) {
-                  double min_dist = std::numeric_limits<double>::max();
-                  for (const auto &c: centroids) {
-                      double dist = calc(data[j]->data(), c.data(), dim);
-                      min_dist = std::min(min_dist, dist);
+      // D^2 sampling loop of plus_plus: draws rows into seeds until there are k, min_dist holds the squared
+      // distance of every row to its closest seed and may still miss the last one
+      void draw_seeds(const std::vector<data_ptr<vec_t>> &data, const double *weights, size_t k,
+                      std::vector<float> &min_dist, std::vector<size_t> &seeds, std::mt19937 &gen) const {
+          size_t n = data.size();
+          auto dim = static_cast<int>(means_.dim_);
+          DistanceCalc<vec_t> calc(L2, dim);
+          Executor *executor = means_.executor_;
+          std::vector<double> chunk_sums((n + kSeedGrain - 1) / kSeedGrain);
+
+          while (seeds.size() < k) {
+              const vec_t *seed = data[seeds.back()];
+              parallel_for(executor, n, kSeedGrain, [&](size_t begin, size_t end, size_t) {
+                  // an inline run gets the whole range at once
+                  for (size_t chunk = begin; chunk < end; chunk += kSeedGrain) {
+                      double sum = 0;
+                      for (size_t j = chunk; j < std::min(end, chunk + kSeedGrain); ++j) {
+                          min_dist[j] = std::min(min_dist[j], calc(data[j], seed, dim));
+                          sum += weights == nullptr ? min_dist[j] : weights[j] * min_dist[j];
+                      }
+                      chunk_sums[chunk / kSeedGrain] = sum;
                   }
-                  distances[j] = min_dist * min_dist;
-                  totalDistance += distances[j];
+              });
+
+              double total = 0;
+              for (auto sum: chunk_sums) {
+                  total += sum;
+              }
+              // every row left coincides with a seed
+              if (!(total > 0)) {
+                  break;
               }
 
-              std::uniform_real_distribution<> prob_dist(0.0, totalDistance);
-              double threshold = prob_dist(gen);
-              double cumulative = 0.0;
-              for (size_t j = 0; j < data.size(); ++j) {
-                  cumulative += distances[j];
-                  if (cumulative >= threshold) {
-                      centroids.push_back(data[j]);
+              double threshold = std::uniform_real_distribution<double>(0.0, total)(gen);
+              size_t chunk = 0;
+              while (chunk + 1 < chunk_sums.size() && threshold >= chunk_sums[chunk]) {
+                  threshold -= chunk_sums[chunk++];
+              }
+              // rounding can run the walk past the last chunk with any mass, or through a chunk without the
+              // threshold going negative, the pick then falls back to the last row that can still be drawn
+              while (chunk > 0 && !(chunk_sums[chunk] > 0)) {
+                  --chunk;
+              }
+              size_t end = std::min(n, (chunk + 1) * kSeedGrain);
+              size_t pick = end;
+              for (size_t j = chunk * kSeedGrain; j < end; ++j) {
+                  double mass = weights == nullptr ? min_dist[j] : weights[j] * min_dist[j];
+                  if (!(mass > 0)) {
+                      continue;
+                  }
+                  pick = j;
+                  threshold -= mass;
+                  if (threshold < 0) {
                       break;
                   }
               }
+              seeds.push_back(pick);
           }
-
-          means_.is_centroid = true;
       }
 
-      std::vector<std::vector<vec_t>> centroids() {
-          return means_.centroids();
-      }
+      std::vector<size_t> parallel_seeds(const std::vector<data_ptr<vec_t>> &data, size_t k,
+                                         std::mt19937 &gen) const {
+          size_t n = data.size();
+          size_t dim = means_.dim_;
+          Executor *executor = means_.executor_;
+          DistanceCalc<vec_t> calc(L2, static_cast<int>(dim));
+          PairwiseDistance<vec_t> pairwise(L2, dim);
+
+          // squared distance of every row to its closest candidate and that candidate
+          std::vector<float> min_dist(n);
+          std::vector<uint32_t> closest(n, 0);
+          std::vector<size_t> candidates{std::uniform_int_distribution<size_t>(0, n - 1)(gen)};
+          parallel_for(executor, n, kSeedGrain, [&](size_t begin, size_t end, size_t) {
+              for (size_t j = begin; j < end; ++j) {
+                  min_dist[j] = calc(data[j], data[candidates[0]], static_cast<int>(dim));
+              }
+          });
+
+          std::vector<size_t> drawn;
+          std::vector<vec_t> base;
+          std::vector<int64_t> labels(n);
+          std::vector<float> dis(n);
+          for (int round = 0; round < seed_rounds_; ++round) {
+              double cost = 0;
+              for (auto d: min_dist) {
+                  cost += d;
+              }
+              if (!(cost > 0)) {
+                  break;
+              }
 
-      void add(data_ptr<vec_t> data) {
-          means_.add(data);
-      }
+              drawn.clear();
+              std::uniform_real_distribution<double> coin(0.0, 1.0);
+              double scale = oversampling_ * static_cast<double>(k) / cost;
+              for (size_t j = 0; j < n; ++j) {
+                  if (coin(gen) < scale * min_dist[j]) {
+                      drawn.push_back(j);
+                  }
+              }
+              if (drawn.empty()) {
+                  continue;
+              }
 
-      void clear() {
-          means_.clear();
-      }
+              base.resize(drawn.size() * dim);
+              for (size_t c = 0; c < drawn.size(); ++c) {
+                  std::copy(data[drawn[c]], data[drawn[c]] + dim, base.begin() + c * dim);
+              }
+              pairwise.set_base(base.data(), drawn.size());
+              auto first = static_cast<uint32_t>(candidates.size());
+              parallel_for(executor, n, kSeedGrain, [&](size_t begin, size_t end, size_t) {
+                  pairwise.nearest(data.data() + begin, end - begin, labels.data() + begin, dis.data() + begin);
+                  for (size_t j = begin; j < end; ++j) {
+                      if (dis[j] < min_dist[j]) {
+                          min_dist[j] = dis[j];
+                          closest[j] = first + static_cast<uint32_t>(labels[j]);
+                      }
+                  }
+              });
+              candidates.insert(candidates.end(), drawn.begin(), drawn.end());
+          }
 
-      void train() {
-          if (is_pp) {
-              centroids_pp(means_.data);
+          // the rounds drew too few, the rest come from D^2 sampling against all the candidates
+          if (candidates.size() <= k) {
+              draw_seeds(data, nullptr, k, min_dist, candidates, gen);
+              return candidates;
           }
 
-          means_.train();
+          std::vector<double> weights(candidates.size(), 0.0);
+          for (size_t j = 0; j < n; ++j) {
+              weights[closest[j]] += 1;
+          }
+          std::vector<data_ptr<vec_t>> rows(candidates.size());
+          for (size_t c = 0; c < candidates.size(); ++c) {
+              rows[c] = data[candidates[c]];
+          }
+          auto picked = plus_plus(rows, weights.data(), k, gen);
+          for (auto &p: picked) {
+              p = candidates[p];
+          }
+          return picked;
       }
 
-      bool is_pp = false;
-      KMeans<vec_t> means_;
+      int seed_rounds_ = 0;
+      double oversampling_ = 2.0;
   };
 
-
 }
\ No newline at end of file
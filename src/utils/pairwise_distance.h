@@ -0,0 +1,238 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <type_traits>
+#include <vector>
+
+#include "utils/bounded_priority_queue.h"
+#include "utils/distance.h"
+
+namespace alp {
+
+  // out[i * ldo + j] = <x[i], y_j> for nx gathered rows against ny rows of y stored back to back
+  template<typename vec_t>
+  static inline void inner_product_tile(const vec_t *const *x, size_t nx, const vec_t *y, size_t ny, int dim,
+                                        float *out, size_t ldo) {
+      for (size_t i = 0; i < nx; ++i) {
+          for (size_t j = 0; j < ny; ++j) {
+              out[i * ldo + j] = ip_distance<vec_t>(x[i], y + j * dim, dim);
+          }
+      }
+  }
+
+  // Many-to-many distances between query rows and a fixed base of rows stored back to back.
+  // Queries are processed in blocks against tiles of the base small enough to stay in cache, the inner
+  // products of each block come from a register blocked kernel and L2 is recovered as |x|^2 + |y|^2 - 2<x, y>
+  // with the base norms computed once in set_base.
+  template<typename vec_t>
+  class PairwiseDistance {
+  public:
+      using idx_t = int64_t;
+
+      PairwiseDistance(DistanceType type, size_t dim) : type_(type), dim_(dim), norm_calc_(IP, dim) {
+          tile_ = std::max<size_t>(kMinTile, kTileBytes / (dim * sizeof(vec_t)));
+          tile_calc = inner_product_tile<vec_t>;
+#if defined(ALP_SIMD_X86)
+          if constexpr (std::is_same_v<vec_t, float>) {
+              switch (simd_level()) {
+                  case kAVX512:
+                      tile_calc = inner_product_tile_avx512;
+                      break;
+                  case kAVX2:
+                      tile_calc = inner_product_tile_avx2;
+                      break;
+                  case kScalar:
+                      break;
+              }
+          }
+#endif
+      }
+
+      void set_base(const vec_t *base, size_t n) {
+          base_ = base;
+          base_num_ = n;
+          base_norms_.resize(n);
+          for (size_t j = 0; j < n; ++j) {
+              base_norms_[j] = norm(base + j * dim_);
+          }
+      }
+
+      size_t base_num() const {
+          return base_num_;
+      }
+
+      bool is_similarity() const {
+          return type_ == IP || type_ == COSINE;
+      }
+
+      // full nx * base_num() distance matrix, row major
+      void compute(const vec_t *const *x, size_t nx, float *out) const {
+          for_each_tile(x, nx, [&](size_t i0, size_t bx, size_t j0, size_t by, const float *tile) {
+              for (size_t i = 0; i < bx; ++i) {
+                  std::copy_n(tile + i * tile_, by, out + (i0 + i) * base_num_ + j0);
+              }
+          });
+      }
+
+      void compute(const vec_t *x, size_t nx, float *out) const {
+          auto rows = gather(x, nx);
+          compute(rows.data(), nx, out);
+      }
+
+      // closest base row of every query row
+      void nearest(const vec_t *const *x, size_t nx, idx_t *labels, float *dis) const {
+          std::fill_n(labels, nx, -1);
+          std::fill_n(dis, nx, worst());
+          bool similarity = is_similarity();
+          for_each_tile(x, nx, [&](size_t i0, size_t bx, size_t j0, size_t by, const float *tile) {
+              for (size_t i = 0; i < bx; ++i) {
+                  const float *row = tile + i * tile_;
+                  float best = dis[i0 + i];
+                  idx_t best_label = labels[i0 + i];
+                  for (size_t j = 0; j < by; ++j) {
+                      if (similarity ? row[j] > best : row[j] < best) {
+                          best = row[j];
+                          best_label = static_cast<idx_t>(j0 + j);
+                      }
+                  }
+                  dis[i0 + i] = best;
+                  labels[i0 + i] = best_label;
+              }
+          });
+      }
+
+      void nearest(const vec_t *x, size_t nx, idx_t *labels, float *dis) const {
+          auto rows = gather(x, nx);
+          nearest(rows.data(), nx, labels, dis);
+      }
+
+      // k closest base rows of every query row written best first, missing slots get label -1
+      void knn(const vec_t *const *x, size_t nx, size_t k, idx_t *labels, float *dis) const {
+          if (is_similarity()) {
+              knn_impl<std::greater<>>(x, nx, k, labels, dis);
+          } else {
+              knn_impl<std::less<>>(x, nx, k, labels, dis);
+          }
+      }
+
+      void knn(const vec_t *x, size_t nx, size_t k, idx_t *labels, float *dis) const {
+          auto rows = gather(x, nx);
+          knn(rows.data(), nx, k, labels, dis);
+      }
+
+  private:
+      static constexpr size_t kBlock = 32;
+      static constexpr size_t kMinTile = 16;
+      static constexpr size_t kTileBytes = 128 * 1024;
+
+      std::vector<const vec_t *> gather(const vec_t *x, size_t nx) const {
+          std::vector<const vec_t *> rows(nx);
+          for (size_t i = 0; i < nx; ++i) {
+              rows[i] = x + i * dim_;
+          }
+          return rows;
+      }
+
+      float worst() const {
+          return is_similarity() ? std::numeric_limits<float>::lowest() : std::numeric_limits<float>::max();
+      }
+
+      float norm(const vec_t *v) const {
+          switch (type_) {
+              case IP:
+                  return 0;
+              case COSINE:
+                  return std::sqrt(norm_calc_(v, v, dim_));
+              default:
+                  return norm_calc_(v, v, dim_);
+          }
+      }
+
+      template<typename Consumer>
+      void for_each_tile(const vec_t *const *x, size_t nx, Consumer &&consume) const {
+          std::vector<float> tile(kBlock * tile_);
+          float x_norms[kBlock];
+
+          for (size_t i0 = 0; i0 < nx; i0 += kBlock) {
+              size_t bx = std::min(kBlock, nx - i0);
+              for (size_t i = 0; i < bx; ++i) {
+                  x_norms[i] = norm(x[i0 + i]);
+              }
+
+              for (size_t j0 = 0; j0 < base_num_; j0 += tile_) {
+                  size_t by = std::min(tile_, base_num_ - j0);
+                  tile_calc(x + i0, bx, base_ + j0 * dim_, by, dim_, tile.data(), tile_);
+
+                  const float *y_norms = base_norms_.data() + j0;
+                  for (size_t i = 0; i < bx; ++i) {
+                      float *row = tile.data() + i * tile_;
+                      switch (type_) {
+                          case IP:
+                              break;
+                          case COSINE:
+                              for (size_t j = 0; j < by; ++j) {
+                                  row[j] /= x_norms[i] * y_norms[j];
+                              }
+                              break;
+                          default:
+                              for (size_t j = 0; j < by; ++j) {
+                                  row[j] = std::max(0.0f, x_norms[i] + y_norms[j] - 2 * row[j]);
+                              }
+                              break;
+                      }
+                  }
+
+                  consume(i0, bx, j0, by, tile.data());
+              }
+          }
+      }
+
+      template<typename Compare>
+      void knn_impl(const vec_t *const *x, size_t nx, size_t k, idx_t *labels, float *dis) const {
+          using queue_type = bounded_priority_queue<std::pair<float, idx_t>, Compare>;
+
+          std::fill_n(labels, nx * k, -1);
+          std::fill_n(dis, nx * k, worst());
+
+          std::vector<queue_type> queues(kBlock, queue_type(k));
+          for_each_tile(x, nx, [&](size_t i0, size_t bx, size_t j0, size_t by, const float *tile) {
+              for (size_t i = 0; i < bx; ++i) {
+                  const float *row = tile + i * tile_;
+                  auto &queue = queues[i];
+                  for (size_t j = 0; j < by; ++j) {
+                      queue.push({row[j], static_cast<idx_t>(j0 + j)});
+                  }
+              }
+
+              if (j0 + by < base_num_) {
+                  return;
+              }
+              for (size_t i = 0; i < bx; ++i) {
+                  auto result = queues[i].dump();
+                  auto *row_labels = labels + (i0 + i) * k;
+                  auto *row_dis = dis + (i0 + i) * k;
+                  for (size_t r = 0; r < result.size(); ++r) {
+                      row_dis[result.size() - 1 - r] = result[r].first;
+                      row_labels[result.size() - 1 - r] = result[r].second;
+                  }
+              }
+          });
+      }
+
+      DistanceType type_;
+      size_t dim_;
+      size_t tile_;
+
+      DistanceCalc<vec_t> norm_calc_;
+
+      const vec_t *base_ = nullptr;
+      size_t base_num_ = 0;
+      std::vector<float> base_norms_;
+
+      void (*tile_calc)(const vec_t *const *x, size_t nx, const vec_t *y, size_t ny, int dim, float *out,
+                        size_t ldo) = nullptr;
+  };
+
+}
@@ -4,7 +4,14 @@
 #include "utils/distance.h"
 #include <cassert>
 #include <algorithm>
+#include <limits>
+#include <type_traits>
 #include "utils/kmeans.h"
+#include "utils/aligned_allocator.h"
+
+#if __has_include(<stdfloat>)
+#include <stdfloat>
+#endif
 
 
 namespace alp {
@@ -12,18 +19,30 @@ namespace alp {
   template<typename vec_t>
   struct Minmax {
       vec_t min_val{std::numeric_limits<vec_t>::max()};
-      vec_t max_val{std::numeric_limits<vec_t>::min()};
+      vec_t max_val{std::numeric_limits<vec_t>::lowest()};
   };
 
+  // codes span [-code_range, code_range], floating point codes stay in [-1, 1] so that squared code distances
+  // cannot overflow
+  template<typename T>
+  static constexpr inline double code_range() {
+      if constexpr (std::numeric_limits<T>::is_integer) {
+          return static_cast<double>(std::numeric_limits<T>::max());
+      } else {
+          return 1.0;
+      }
+  }
+
+  // values outside the trained range saturate instead of wrapping around
   template<typename T, typename vec_t>
   static constexpr inline T clamp2T(vec_t val, const Minmax<vec_t> &minmax, double diff) {
-      return static_cast<T>(2.0 * ((static_cast<double>(val) - minmax.min_val) /
-                                   diff - 0.5) * std::numeric_limits<T>::max());
+      return static_cast<T>(std::clamp(2.0 * ((static_cast<double>(val) - minmax.min_val) /
+                                              diff - 0.5) * code_range<T>(), -code_range<T>(), code_range<T>()));
   }
 
   template<typename T, typename vec_t>
-  static constexpr inline T clampT2(T val, const Minmax<vec_t> &minmax, double diff) {
-      return (static_cast<double>(val) / 2.0 / static_cast<double >(std::numeric_limits<T>::max()) + 0.5) *
+  static constexpr inline vec_t clampT2(T val, const Minmax<vec_t> &minmax, double diff) {
+      return (static_cast<double>(val) / 2.0 / code_range<T>() + 0.5) *
              diff + minmax.min_val;
   }
 
@@ -34,7 +53,7 @@ namespace alp {
   }
 
   template<typename T, typename vec_t>
-  static constexpr inline T clampT2(T val, const Minmax<vec_t> &minmax) {
+  static constexpr inline vec_t clampT2(T val, const Minmax<vec_t> &minmax) {
       return clampT2<T, vec_t>(val, minmax, (static_cast<double >(minmax.max_val) - minmax.min_val));
   }
 
@@ -45,7 +64,7 @@ namespace alp {
       std::vector<T> result;
       result.reserve(dim);
       for (size_t i = 0; i < dim; ++i) {
-          result.push_back(clamp2T(data[i], minmax, diff));
+          result.push_back(clamp2T<T>(data[i], minmax, diff));
       }
       return result;
   }
@@ -63,7 +82,7 @@ namespace alp {
 
   template<typename T, typename vec_t>
   static inline std::vector<vec_t> scalar_dequantize_with_plus(const Minmax<vec_t> &minmax, const T *data, size_t dim,
-                                                               const T *bias,
+                                                               const vec_t *bias,
                                                                double diff) {
       std::vector<vec_t> result;
       result.reserve(dim);
@@ -74,265 +93,513 @@ namespace alp {
   }
 
 
+  // sum of (r_i - scale * code_i)^2, r is the query with everything but the scaled code already subtracted
+  template<typename T>
+  static inline float sq_l2_distance(const float *r, const T *code, int size, float scale) {
+      float sum = 0;
+      for (int i = 0; i < size; i++) {
+          float diff = r[i] - scale * static_cast<float>(code[i]);
+          sum += diff * diff;
+      }
+      return sum;
+  }
+
   template<typename T, typename vec_t>
-  class IVF_ScalarQuantizer {
-  private:
-      std::vector<vec_t> pre_handle(const vec_t *data, size_t dim) {
-          std::vector<vec_t> result;
-          result.reserve(dim);
-          for (size_t i = 0; i < dim; ++i) {
-              result.emplace_back(data[i] - cluster_centers_[i]);
+  static inline float sq_ip_distance(const vec_t *q, const T *code, int size) {
+      float sum = 0;
+      for (int i = 0; i < size; i++) {
+          sum += q[i] * static_cast<float>(code[i]);
+      }
+      return sum;
+  }
+
+  // Distances between a float query and scalar quantizer codes, the codes are widened in registers instead of
+  // being dequantised into a temporary vector.
+  template<typename T, typename vec_t>
+  struct SQDistanceCalc {
+      SQDistanceCalc() {
+          l2_calc = sq_l2_distance<T>;
+          ip_calc = sq_ip_distance<T, vec_t>;
+          code_l2_calc = l2_distance<T>;
+#if defined(ALP_SIMD_X86)
+          if constexpr (std::is_same_v<vec_t, float>) {
+              if constexpr (std::is_same_v<T, float>) {
+                  bind<FloatCodes>();
+              } else if constexpr (std::is_same_v<T, int8_t>) {
+                  bind<Int8Codes>();
+                  if (simd_has_vnni()) {
+                      code_l2_calc = l2_distance_int8_vnni;
+                  } else if (simd_level() != kScalar) {
+                      code_l2_calc = l2_distance_int8_avx2;
+                  }
+#if defined(__STDCPP_FLOAT16_T__)
+              } else if constexpr (std::is_same_v<T, std::float16_t>) {
+                  bind<FP16Codes>();
+#endif
+#if defined(__STDCPP_BFLOAT16_T__)
+              } else if constexpr (std::is_same_v<T, std::bfloat16_t>) {
+                  bind<BF16Codes>();
+#endif
+              }
           }
-          return result;
+#endif
       }
 
-      std::vector<vec_t> de_pre_dequantize(const vec_t *data, size_t dim) {
-          scalar_dequantize_with_plus(minmax_, data, dim, cluster_centers_.data(), diff_);
+      float (*l2_calc)(const float *r, const T *code, int size, float scale) = nullptr;
+      float (*ip_calc)(const vec_t *q, const T *code, int size) = nullptr;
+      // L2 between two code vectors, in code units
+      float (*code_l2_calc)(const T *a, const T *b, int size) = nullptr;
+
+  private:
+#if defined(ALP_SIMD_X86)
+      template<typename Codes>
+      void bind() {
+          switch (simd_level()) {
+              case kAVX512:
+                  l2_calc = sq_l2_distance_avx512<Codes, T>;
+                  ip_calc = sq_ip_distance_avx512<Codes, T>;
+                  break;
+              case kAVX2:
+                  l2_calc = sq_l2_distance_avx2<Codes, T>;
+                  ip_calc = sq_ip_distance_avx2<Codes, T>;
+                  break;
+              case kScalar:
+                  break;
+          }
       }
+#endif
+  };
+
 
+  template<typename T, typename vec_t>
+  class IVF_ScalarQuantizer {
   public:
-      IVF_ScalarQuantizer(std::vector<vec_t> &cluster_centers)
+      // A code decodes to centroid + offset + scale * code, so everything but the scaled code is folded into
+      // these per query terms once per cluster.
+      struct QueryTerms {
+          // query - centroid - offset
+          std::vector<float> residual;
+          // <query, centroid + offset>
+          float ip_bias = 0;
+      };
+
+      IVF_ScalarQuantizer(const std::vector<vec_t> &cluster_centers)
               : cluster_centers_(cluster_centers) {
       }
 
       IVF_ScalarQuantizer() = delete;
 
       void clear() {
-          clusters_.clear();
+          residuals_.clear();
+          residuals_.shrink_to_fit();
+      }
+
+      // fixes the code range from the residuals added so far
+      void train() {
+          diff_ = (static_cast<double >(minmax_.max_val) - minmax_.min_val);
+          if (!(diff_ > 0)) {
+              diff_ = 1;
+          }
+          scale_ = diff_ / code_range<T>() / 2.0;
+          offset_ = diff_ / 2.0 + minmax_.min_val;
       }
 
       std::vector<std::vector<T>> train_clusters() {
+          train();
+
           std::vector<std::vector<T>> quantized_clusters_;
           auto dim = cluster_centers_.size();
-          quantized_clusters_.reserve(clusters_.size());
-          for (size_t i = 0; i < clusters_.size(); ++i) {
-              quantized_clusters_.emplace_back(quantize_cluster(clusters_[i].data(), dim));
+          quantized_clusters_.reserve(cluster_num());
+          for (size_t i = 0; i < cluster_num(); ++i) {
+              quantized_clusters_.emplace_back(quantize_cluster(cluster(i), dim));
           }
-          diff_ = (static_cast<double >(minmax_.max_val) - minmax_.min_val);
-          scale_ = diff_ / static_cast<double >(std::numeric_limits<T>::max()) / 2.0;
 
           return quantized_clusters_;
       }
 
-
+      // residuals are staged back to back until train
       void add_cluster(const vec_t *data, size_t dim) {
-          clusters_.emplace_back(pre_handle(data, dim));
-          update_minmax(clusters_.back().data(), dim);
+          auto begin = residuals_.size();
+          residuals_.resize(begin + dim);
+          for (size_t i = 0; i < dim; ++i) {
+              residuals_[begin + i] = data[i] - cluster_centers_[i];
+          }
+          update_minmax(residuals_.data() + begin, dim);
       }
 
-      std::vector<T> quantize_cluster(const vec_t *data, size_t dim) {
-          return scalar_quantize(minmax_, data, dim, diff_);
+      size_t cluster_num() const {
+          return cluster_centers_.empty() ? 0 : residuals_.size() / cluster_centers_.size();
       }
 
-      std::vector<vec_t> dequantize_cluster(const T *data, size_t dim) {
-          return scalar_dequantize(minmax_, data, dim, diff_);
+      const vec_t *cluster(size_t i) const {
+          return residuals_.data() + i * cluster_centers_.size();
       }
 
-      float compute_distance_l2(const vec_t *qvec, const T *c_vec) const {
-          const size_t dim_ = cluster_centers_.size();
-
-          auto dequantized_vec = dequantize_cluster(c_vec, dim_);
-
-          return l2_distance<T>(qvec, dequantized_vec.data(), dim_);
+      std::vector<T> quantize_cluster(const vec_t *data, size_t dim) const {
+          return scalar_quantize<T>(minmax_, data, dim, diff_);
       }
 
-      float compute_distance_l2(const T *qvec, const T *c_vec) const {
-          return l2_distance<vec_t>(qvec, c_vec, cluster_centers_.size()) * (scale_ * scale_);
+      void quantize_cluster(const vec_t *data, size_t dim, T *code) const {
+          for (size_t i = 0; i < dim; ++i) {
+              code[i] = clamp2T<T>(data[i], minmax_, diff_);
+          }
       }
 
-      float compute_distance_ip(const vec_t *qvec, const T *c_vec) const {
-          const size_t dim_ = cluster_centers_.size();
-
-          auto dequantized_vec = de_pre_dequantize(c_vec, dim_);
-
-          return ip_distance<vec_t>(qvec, dequantized_vec.data(), dim_);
+      // encodes a vector of the cluster itself rather than its residual
+      void encode(const vec_t *data, T *code) const {
+          for (size_t i = 0; i < cluster_centers_.size(); ++i) {
+              code[i] = clamp2T<T>(static_cast<vec_t>(data[i] - cluster_centers_[i]), minmax_, diff_);
+          }
       }
 
-      float compute_distance_ip(const T *qvec, const T *c_vec) const {
-          assert(false && "Not support");
+      // the decoded residual, add the centroid back for the vector itself
+      std::vector<vec_t> dequantize_cluster(const T *data, size_t dim) const {
+          return scalar_dequantize<T>(minmax_, data, dim, diff_);
       }
 
-      float compute_distance_cosine(const vec_t *qvec, const T *c_vec) const {
+      void prepare_query(const vec_t *qvec, QueryTerms &terms) const {
           const size_t dim_ = cluster_centers_.size();
+          terms.residual.resize(dim_);
+          float bias = 0;
+          for (size_t i = 0; i < dim_; ++i) {
+              float base = static_cast<float>(cluster_centers_[i] + offset_);
+              terms.residual[i] = qvec[i] - base;
+              bias += qvec[i] * base;
+          }
+          terms.ip_bias = bias;
+      }
 
-          auto dequantized_vec = de_pre_dequantize(c_vec, dim_);
-
-          return cosine_distance<vec_t>(qvec, dequantized_vec.data(), dim_);
+      float compute_distance_l2(const QueryTerms &terms, const T *c_vec) const {
+          return calc_.l2_calc(terms.residual.data(), c_vec, cluster_centers_.size(), scale_);
       }
 
+      float compute_distance_l2(const T *qvec, const T *c_vec) const {
+          return calc_.code_l2_calc(qvec, c_vec, cluster_centers_.size()) * (scale_ * scale_);
+      }
 
-      float compute_distance_cosine(const T *qvec, const T *c_vec) const {
-          assert(false && "Not support");
+      float compute_distance_ip(const vec_t *qvec, const QueryTerms &terms, const T *c_vec) const {
+          return scale_ * calc_.ip_calc(qvec, c_vec, cluster_centers_.size()) + terms.ip_bias;
       }
 
   private:
 
-      void update_minmax(const vec_t *data, size_t size) const {
+      void update_minmax(const vec_t *data, size_t size) {
           for (size_t i = 0; i < size; ++i) {
               minmax_.min_val = std::min(minmax_.min_val, data[i]);
               minmax_.max_val = std::max(minmax_.max_val, data[i]);
           }
       }
 
-      double diff_;
-      double scale_;
+      double diff_ = 1;
+      double scale_ = 0;
+      double offset_ = 0;
 
-      std::vector<std::vector<vec_t>> clusters_;
-      std::vector<vec_t> &cluster_centers_;
+      std::vector<vec_t> residuals_;
+      const std::vector<vec_t> &cluster_centers_;
       Minmax<vec_t> minmax_;
+      SQDistanceCalc<T, vec_t> calc_;
   };
 
 
-  template<typename vec_t>
-  class IVF_ProductQuantizer {
-  private:
-      std::vector<vec_t> pre_handle(const vec_t *data, size_t dim) {
-          std::vector<vec_t> result;
-          result.reserve(dim);
-          for (size_t i = 0; i < dim; ++i) {
-              result.emplace_back(data[i] - cluster_centers_[i]);
-          }
-          return result;
+  // sum of the table entries picked by the m bytes of a code
+  static inline float pq_adc_distance(const float *table, const uint8_t *code, int m) {
+      float sum = 0;
+      for (int i = 0; i < m; ++i) {
+          sum += table[i * kPQTableStride + code[i]];
       }
+      return sum;
+  }
 
-  public:
-      IVF_ProductQuantizer(std::vector<std::vector<vec_t>> &cluster_centers, int m = 8)
-              : cluster_centers_(cluster_centers), m_(m) {
-          assert(m > 0);
-          chunk_size_ = (cluster_centers_.size()) / m_;
-          codebooks_.reserve(m_);
+  // uint8 tables of a 4-bit product quantizer laid out like a PackedInvertedList block, 16 entries per sub
+  // quantizer, a sum s of entries stands for the distance s / scale + bias
+  struct PQ4Table {
+      std::vector<uint8_t, AlignedAllocator<uint8_t>> lut;
+      float scale = 1;
+      float bias = 0;
+  };
+
+  // out[j] = saturated sum of the table entries picked by row j of a block of 32 packed 4-bit codes
+  static inline void pq4_scan_block(const uint8_t *lut, const uint8_t *block, int pairs, uint16_t *out) {
+      for (int j = 0; j < 32; ++j) {
+          uint32_t sum = 0;
+          for (int p = 0; p < pairs * 2; ++p) {
+              uint8_t byte = block[p * 16 + j % 16];
+              uint8_t code = j < 16 ? byte & 0x0F : byte >> 4;
+              sum += lut[p * 16 + code];
+          }
+          out[j] = static_cast<uint16_t>(std::min<uint32_t>(sum, std::numeric_limits<uint16_t>::max()));
       }
+  }
 
-      void clear() {
-          clusters_.clear();
+  using pq4_scan_func = void (*)(const uint8_t *lut, const uint8_t *block, int pairs, uint16_t *out);
+
+  static inline pq4_scan_func pq4_scan_kernel() {
+#if defined(ALP_SIMD_X86)
+      switch (simd_level()) {
+          case kAVX512:
+              return pq4_scan_block_avx512;
+          case kAVX2:
+              return pq4_scan_block_avx2;
+          case kScalar:
+              break;
       }
+#endif
+      return pq4_scan_block;
+  }
 
-      std::vector<std::vector<uint8_t>> train_clusters() {
-          std::vector<std::vector<uint8_t>> quantized_clusters_;
-          if (chunk_size_ == 0) {
-              return quantized_clusters_;
-          }
+  // Product quantizer over the residuals of one cluster, a code keeps one byte per sub quantizer with 2^nbits
+  // centroids each.
+  // Distances are asymmetric: a query builds an m x ksub table of its distances to every sub centroid once per
+  // cluster and a code then costs m lookups into it.
+  template<typename vec_t>
+  class IVF_ProductQuantizer {
+  public:
+      static constexpr size_t kCodebookSize = kPQTableStride;
 
-          assert(clusters_.size() > 8);
+      // table[i * kPQTableStride + j] is the distance of sub vector i to sub centroid j, bias is added once
+      struct QueryTable {
+          std::vector<float> table;
+          float bias = 0;
+      };
+
+      IVF_ProductQuantizer(const std::vector<vec_t> &cluster_centers, int m = 8, int nbits = 8)
+              : cluster_centers_(cluster_centers), ksub_max_(size_t(1) << nbits) {
+          assert(m > 0 && nbits > 0 && nbits <= 8);
           auto dim = cluster_centers_.size();
+          m_ = static_cast<int>(std::max<size_t>(1, std::min<size_t>(m, dim)));
+          auto chunk_size = dim / m_;
+          sub_begin_.resize(m_ + 1);
+          for (int i = 0; i < m_; ++i) {
+              sub_begin_[i] = i * chunk_size;
+          }
+          // the last sub quantizer takes the remainder
+          sub_begin_[m_] = dim;
+
+          adc_calc = pq_adc_distance;
+#if defined(ALP_SIMD_X86)
+          switch (simd_level()) {
+              case kAVX512:
+                  adc_calc = pq_adc_distance_avx512;
+                  break;
+              case kAVX2:
+                  adc_calc = pq_adc_distance_avx2;
+                  break;
+              case kScalar:
+                  break;
+          }
+#endif
+      }
 
-          auto last_dim = dim - (m_ - 1) * chunk_size_;
+      IVF_ProductQuantizer() = delete;
 
-          std::vector<KMeansPP<vec_t>> kmeans;
-          kmeans.reserve(m_);
+      void clear() {
+          residuals_.clear();
+          residuals_.shrink_to_fit();
+      }
 
-          for (size_t i = 0; i < m_; ++i) {
-              if (i == m_ - 1) {
-                  kmeans.emplace_back(last_dim, dim);
-              } else {
-                  kmeans.emplace_back(chunk_size_, dim);
-              }
+      // residuals are staged back to back until train
+      void add_cluster(const vec_t *data, size_t dim) {
+          auto begin = residuals_.size();
+          residuals_.resize(begin + dim);
+          for (size_t i = 0; i < dim; ++i) {
+              residuals_[begin + i] = data[i] - cluster_centers_[i];
           }
+      }
 
-          for (const auto &data: clusters_) {
-              for (size_t i = 0; i < m_; ++i) {
-                  kmeans[i].add(data.data() + i * chunk_size_);
-              }
-          }
+      size_t cluster_num() const {
+          return cluster_centers_.empty() ? 0 : residuals_.size() / cluster_centers_.size();
+      }
 
-          for (size_t i = 0; i < m_; ++i) {
-              kmeans[i].train();
-              codebooks_.emplace_back(kmeans[i].centroids());
-          }
+      const vec_t *cluster(size_t i) const {
+          return residuals_.data() + i * cluster_centers_.size();
+      }
 
-          quantized_clusters_.reserve(clusters_.size());
-          for (const auto &data: clusters_) {
-              quantized_clusters_.emplace_back(quantize_cluster(data.data(), dim));
+      // trains one codebook per sub quantizer on the staged residuals, codebook i is stored as ksub rows of
+      // sub_dim(i) values starting at codebooks_[kCodebookSize * sub_begin_[i]]
+      void train() {
+          auto n = cluster_num();
+          codebooks_.assign(kCodebookSize * cluster_centers_.size(), 0);
+          ksub_ = 0;
+          if (n == 0) {
+              return;
           }
 
-          for (auto i = 0; i < m_; ++i) {
-              auto &codebook = codebooks_[i];
-              auto &cluster = clusters_[i];
-              for (size_t j = 0; j < codebook.size(); ++j) {
-                  auto &code = codebook[j];
-                  for (size_t k = 0; k < code.size(); ++k) {
-                      code[k] += cluster_centers_[i * chunk_size_ + k];
-                  }
+          for (int i = 0; i < m_; ++i) {
+              KMeansPP<vec_t> kmeans(ksub_max_, sub_dim(i), kTrainIters);
+              kmeans.set_max_points_per_centroid(kTrainPointsPerCentroid);
+              for (size_t j = 0; j < n; ++j) {
+                  kmeans.add(residuals_.data() + j * cluster_centers_.size() + sub_begin_[i]);
               }
-          }
+              kmeans.train();
 
-          return quantized_clusters_;
+              auto centroids = kmeans.centroids();
+              ksub_ = centroids.size();
+              vec_t *codebook = codebooks_.data() + kCodebookSize * sub_begin_[i];
+              for (size_t j = 0; j < centroids.size(); ++j) {
+                  std::copy(centroids[j].begin(), centroids[j].end(), codebook + j * sub_dim(i));
+              }
+          }
       }
 
+      std::vector<std::vector<uint8_t>> train_clusters() {
+          train();
 
-      void add_cluster(const vec_t *data, size_t dim) {
-          clusters_.emplace_back(pre_handle(data, dim));
+          std::vector<std::vector<uint8_t>> quantized_clusters_;
+          quantized_clusters_.reserve(cluster_num());
+          for (size_t i = 0; i < cluster_num(); ++i) {
+              quantized_clusters_.emplace_back(quantize_cluster(cluster(i), cluster_centers_.size()));
+          }
+          return quantized_clusters_;
       }
 
-      std::vector<uint8_t> quantize_cluster(const vec_t *data, size_t dim) {
-          std::vector<uint8_t> result;
-          result.reserve(m_);
-
-          for (size_t i = 0; i < m_; ++i) {
-              auto &codebook = codebooks_[i];
-              auto data_chunk = data + i * chunk_size_;
+      // code of a residual
+      void quantize_cluster(const vec_t *data, uint8_t *code) const {
+          for (int i = 0; i < m_; ++i) {
+              auto dsub = sub_dim(i);
+              const vec_t *sub = data + sub_begin_[i];
+              const vec_t *codebook = codebooks_.data() + kCodebookSize * sub_begin_[i];
               float min_dis = std::numeric_limits<float>::max();
-              int min_index = -1;
-
+              size_t min_index = 0;
 
-              for (size_t k = 0; k < codebook.size(); ++k) {
-                  auto dis = l2_distance(data_chunk, codebook[k].data(), codebook[k].size());
+              for (size_t j = 0; j < ksub_; ++j) {
+                  auto dis = l2_distance<vec_t>(sub, codebook + j * dsub, static_cast<int>(dsub));
                   if (dis < min_dis) {
                       min_dis = dis;
-                      min_index = static_cast<int>(k);
+                      min_index = j;
                   }
               }
-              result.push_back(static_cast<uint8_t>(min_index));
+              code[i] = static_cast<uint8_t>(min_index);
           }
+      }
 
-
+      std::vector<uint8_t> quantize_cluster(const vec_t *data, size_t dim) const {
+          std::vector<uint8_t> result(m_);
+          quantize_cluster(data, result.data());
           return result;
       }
 
-      std::vector<vec_t> dequantize_cluster(const uint8_t *data, size_t dim) {
+      // encodes a vector of the cluster itself rather than its residual
+      void encode(const vec_t *data, uint8_t *code) const {
+          std::vector<vec_t> residual(cluster_centers_.size());
+          for (size_t i = 0; i < residual.size(); ++i) {
+              residual[i] = data[i] - cluster_centers_[i];
+          }
+          quantize_cluster(residual.data(), code);
+      }
+
+      // the decoded residual, add the centroid back for the vector itself
+      std::vector<vec_t> dequantize_cluster(const uint8_t *data, size_t dim) const {
           std::vector<vec_t> result;
           result.reserve(dim);
 
-          for (size_t i = 0; i < m_; ++i) {
-              auto &codebook = codebooks_[i];
-              auto index = data[i];
-              result.insert(result.end(), codebook[index].begin(), codebook[index].end());
+          for (int i = 0; i < m_; ++i) {
+              auto dsub = sub_dim(i);
+              const vec_t *c = codebooks_.data() + kCodebookSize * sub_begin_[i] + data[i] * dsub;
+              result.insert(result.end(), c, c + dsub);
           }
 
           return result;
       }
 
-      float compute_distance_l2(const vec_t *qvec, const uint8_t *c_vec) const {
-          const size_t dim_ = cluster_centers_.size();
+      // L2 tables hold |q - centroid - c_ij|^2, IP tables hold <q, c_ij> with <q, centroid> as the bias
+      void prepare_query(DistanceType type, const vec_t *qvec, QueryTable &query) const {
+          auto dim = cluster_centers_.size();
+          query.table.resize(m_ * kCodebookSize);
+          query.bias = 0;
 
-          auto dequantized_vec = dequantize_cluster(c_vec, dim_);
+          std::vector<float> q(dim);
+          if (type == L2) {
+              for (size_t i = 0; i < dim; ++i) {
+                  q[i] = qvec[i] - cluster_centers_[i];
+              }
+          } else {
+              for (size_t i = 0; i < dim; ++i) {
+                  q[i] = qvec[i];
+                  query.bias += qvec[i] * cluster_centers_[i];
+              }
+          }
 
-          return l2_distance<vec_t>(qvec, dequantized_vec.data(), dim_);
+          for (int i = 0; i < m_; ++i) {
+              auto dsub = sub_dim(i);
+              const float *sub = q.data() + sub_begin_[i];
+              const vec_t *codebook = codebooks_.data() + kCodebookSize * sub_begin_[i];
+              float *row = query.table.data() + i * kCodebookSize;
+              for (size_t j = 0; j < ksub_; ++j) {
+                  const vec_t *c = codebook + j * dsub;
+                  float dis = 0;
+                  if (type == L2) {
+                      for (size_t d = 0; d < dsub; ++d) {
+                          float diff = sub[d] - c[d];
+                          dis += diff * diff;
+                      }
+                  } else {
+                      for (size_t d = 0; d < dsub; ++d) {
+                          dis += sub[d] * c[d];
+                      }
+                  }
+                  row[j] = dis;
+              }
+          }
       }
 
-      float compute_distance_ip(const vec_t *qvec, const uint8_t *c_vec) const {
-          const size_t dim_ = cluster_centers_.size();
-
-          auto dequantized_vec = dequantize_cluster(c_vec, dim_);
+      // quantises a 4-bit query table to uint8 entries: each sub quantizer is shifted by its minimum, which goes
+      // into the bias, and all share one scale mapping the widest range onto 0-255
+      void prepare_fast_scan(const QueryTable &query, PQ4Table &out) const {
+          assert(ksub_max_ <= 16);
+          int pairs = (m_ + 1) / 2;
+          out.lut.assign(pairs * 32, 0);
+          out.bias = query.bias;
+
+          std::vector<float> mins(m_, 0);
+          float range = 0;
+          for (int i = 0; i < m_; ++i) {
+              const float *row = query.table.data() + i * kCodebookSize;
+              if (ksub_ == 0) {
+                  continue;
+              }
+              auto [lo, hi] = std::minmax_element(row, row + ksub_);
+              mins[i] = *lo;
+              range = std::max(range, *hi - *lo);
+              out.bias += *lo;
+          }
 
-          return ip_distance<vec_t>(qvec, dequantized_vec.data(), dim_);
+          out.scale = range > 0 ? 255.0f / range : 1.0f;
+          for (int i = 0; i < m_; ++i) {
+              const float *row = query.table.data() + i * kCodebookSize;
+              uint8_t *lut = out.lut.data() + i * 16;
+              for (size_t j = 0; j < ksub_; ++j) {
+                  lut[j] = static_cast<uint8_t>(std::lround((row[j] - mins[i]) * out.scale));
+              }
+          }
       }
 
-      float compute_distance_cosine(const vec_t *qvec, const uint8_t *c_vec) const {
-          const size_t dim_ = cluster_centers_.size();
+      float compute_distance(const QueryTable &query, const uint8_t *code) const {
+          return query.bias + adc_calc(query.table.data(), code, m_);
+      }
 
-          auto dequantized_vec = dequantize_cluster(c_vec, dim_);
+      size_t code_size() const {
+          return m_;
+      }
 
-          return cosine_distance<vec_t>(qvec, dequantized_vec.data(), dim_);
+      size_t sub_dim(int i) const {
+          return sub_begin_[i + 1] - sub_begin_[i];
       }
 
   private:
-      std::vector<std::vector<vec_t>> clusters_;
-      std::vector<vec_t> &cluster_centers_;
+      static constexpr int kTrainIters = 25;
+      // codebooks train on a sample of at most this many residuals per code
+      static constexpr size_t kTrainPointsPerCentroid = 256;
+
+      std::vector<vec_t> residuals_;
+      const std::vector<vec_t> &cluster_centers_;
 
-      std::vector<std::vector<std::vector<vec_t>>> codebooks_;
-      size_t chunk_size_;
+      std::vector<vec_t> codebooks_;
+      std::vector<size_t> sub_begin_;
+      size_t ksub_max_;
+      size_t ksub_ = 0;
       int m_ = 8;
+
+      float (*adc_calc)(const float *table, const uint8_t *code, int m) = nullptr;
   };
 
 }